@@ -2,11 +2,24 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
 #include "gtmxc_types.h"
+#include "libyottadb.h"
 
 #define ERROR_BASE 16384
 #define MSTR_LIMIT 1048576
@@ -36,6 +49,13 @@ enum error_number {
   E_MEM,
   E_END,
   E_GROUP,
+  E_ARG,
+  E_HANDLE,
+  E_NAME,
+  E_YDB,
+  E_FILE,
+  E_MATCHLIMIT,
+  E_TIMEOUT,
 };
 
 char *error_messages[] = {
@@ -50,11 +70,19 @@ char *error_messages[] = {
   [E_MEM]      = "%PCRE-E-MEM, Out of memory",
   [E_END]      = "%PCRE-E-END, No more matches",
   [E_GROUP]    = "%PCRE-E-GROUP, Invalid capture group name or index",
+  [E_ARG]      = "%PCRE-E-ARG, Invalid argument",
+  [E_HANDLE]   = "%PCRE-E-HANDLE, Invalid match handle",
+  [E_NAME]     = "%PCRE-E-NAME, Invalid variable name",
+  [E_YDB]      = "%PCRE-E-YDB, YottaDB error: ",
+  [E_FILE]     = "%PCRE-E-FILE, File error: ",
+  [E_MATCHLIMIT] = "%PCRE-E-MATCHLIMIT, Resource limit exceeded: ",
+  [E_TIMEOUT]  = "%PCRE-E-TIMEOUT, Match time limit exceeded",
 };
 
 typedef struct {
   const char *func;
   int number;
+  int status;  // YottaDB status of E_YDB
   struct {
     char text[300];
     int length;
@@ -79,6 +107,11 @@ static void clear_error(error_t *error, const char *func) {
     NULL; \
   })
 
+#define ERROR_INT(code) ({ \
+    error->number = code; \
+    -1; \
+  })
+
 #define min(a,b) \
   ({ __typeof__ (a) _a = (a); \
      __typeof__ (b) _b = (b); \
@@ -176,51 +209,28 @@ static void error_append_pcre_message(error_t *error, int pcre_number) {
   error->append.length += pcre2_get_error_message(pcre_number, (PCRE2_UCHAR8 *)error->append.text + error->append.length, remaining);
 }
 
-typedef struct {
-  pcre2_code *re;
-  uint32_t groups;
-  pcre2_match_data *data;
-  int all;
-  int vector;
-  input_t text;
-  input_t sep;
-  int utf8;
-  int crlf;
-  int next;
-  struct {
-    PCRE2_SPTR table;
-    uint32_t entry_size;
-    uint32_t count;
-  } names;
-} context_t;
-
-static context_t match_context;
-
-static void clear_context(context_t *context) {
-  if (!context->re) {
-    return;
-  }
-  pcre2_code_free(context->re);
-  if (context->data) {
-    pcre2_match_data_free(context->data);
-  }
-  if (context->text.address) {
-    free(context->text.address);
+// Error number for a failed match, resource limits and timeouts have their own
+static int match_error(error_t *error, int rc, int number) {
+  switch (rc) {
+    case PCRE2_ERROR_CALLOUT:
+      return E_TIMEOUT;
+    case PCRE2_ERROR_MATCHLIMIT:
+    case PCRE2_ERROR_DEPTHLIMIT:
+    case PCRE2_ERROR_HEAPLIMIT:
+      number = E_MATCHLIMIT;
   }
-  if (context->sep.address) {
-    free(context->sep.address);
-  }
-  memset(context, '\0', sizeof(*context));
+  error_append_pcre_message(error, rc);
+  return number;
 }
 
-static int copy_input(error_t *error, input_t *dst, input_t *src) {
-  dst->address = malloc(src->length);
-  if (!dst->address) {
-    return ERROR_FAIL(E_MEM);
+static int ydb_error(error_t *error, int status) {
+  char text[sizeof(error->append.text)];
+  if (ydb_zstatus(text, sizeof(text)) != YDB_OK || !*text) {
+    snprintf(text, sizeof(text), "status %d", status);
   }
-  memcpy(dst->address, src->address, src->length);
-  dst->length = src->length;
-  return OK;
+  error_append(error, "%s", text);
+  error->status = status;
+  return ERROR_FAIL(E_YDB);
 }
 
 typedef struct {
@@ -232,6 +242,7 @@ typedef struct {
   int z;  // no PCRE2_UTF|PCRE2_UCP, much faster, as always in M: 'z' is synonim for speed
   int a;  // all matched string in first record field
   int v;  // return ovector in record
+  int j;  // pcre2_jit_compile() right away, reused patterns are JIT-compiled anyway
 } regex_opts_t;
 
 static int parse_regex_opts(regex_opts_t *opts, char *begin, char *end) {
@@ -263,6 +274,9 @@ static int parse_regex_opts(regex_opts_t *opts, char *begin, char *end) {
       case 'v':
         opts->v++;
         break;
+      case 'j':
+        opts->j++;
+        break;
       default:
         return FAIL;
     }
@@ -308,511 +322,5661 @@ static int parse_regex(error_t *error, input_t *regex, input_t *pattern, regex_o
   return OK;
 }
 
-static int regex_compile(error_t *error, pcre2_code **re, regex_opts_t *opts, input_t *pattern) {
-  input_t regex;
-  if (!parse_regex(error, &regex, pattern, opts)) {
+// Pattern without metacharacters, matched by a substring search instead of PCRE2
+typedef struct {
+  char *address;  // into pattern->key
+  int length;     // 0 for other patterns
+  int caseless;   // ASCII only, 'i' with 'z'
+  unsigned char first[2];  // first and last byte in both cases
+  unsigned char last[2];
+} literal_t;
+
+// Necessary conditions for a match taken from the compiled pattern, checked before pcre2_match()
+typedef struct {
+  int enabled;
+  uint32_t length;       // minimum subject length in characters, so also in bytes
+  int units;
+  char unit[2];          // code units every match contains (first and last)
+  literal_t required[2]; // the units as one byte literals, in both ASCII cases
+  int bitmap;
+  uint8_t first[32];     // possible first code units of a match
+} prefilter_t;
+
+// Capture group names hashed to their entries in the PCRE2 name table, built on first use
+typedef struct {
+  int built;
+  uint32_t count;
+  uint32_t entry_size;
+  PCRE2_SPTR table;
+  uint32_t mask;
+  uint32_t *slots;  // name table entry + 1, 0 is empty
+} names_t;
+
+typedef struct pattern {
+  pcre2_code *re;
+  regex_opts_t opts;
+  literal_t literal;
+  prefilter_t prefilter;
+  names_t names;
+  int utf8;
+  int crlf;
+  int jit;
+  int uses;
+  int refs;
+  int cached;
+  long size;
+  uint32_t hash;
+  struct pattern *prev;   // LRU list, most recently used first
+  struct pattern *next;
+  struct pattern *chain;  // hash bucket
+  int length;
+  char key[];             // "/regex/opts" as given by the caller
+} pattern_t;
+
+#define CACHE_SIZE 256
+#define CACHE_MEMORY 16777216
+#define CACHE_SIZE_MAX 65536
+#define CACHE_MEMORY_MAX (1L << 40)
+
+typedef struct {
+  int initialized;
+  int size;       // max patterns, 0 disables the cache
+  long memory;    // max bytes
+  int count;
+  long used;
+  long hits;
+  long misses;
+  pattern_t *head;
+  pattern_t *tail;
+  pattern_t **buckets;
+  uint32_t mask;
+} cache_t;
+
+static cache_t cache;
+
+#define isdigit(n) \
+  ({ __typeof__ (n) _n = (n); \
+     _n >= '0' && _n <= '9'; })
+
+#define isalpha(c) \
+  ({ __typeof__ (c) _c = (c); \
+     (_c >= 'a' && _c <= 'z') || (_c >= 'A' && _c <= 'Z'); })
+
+static int parse_int(input_t *input, int *result, int max_digits) {
+  if (input->length > max_digits) {
     return FAIL;
   }
-  uint32_t compile_options = regex_compile_options(opts);
-  int error_number;
-  PCRE2_SIZE error_offset;
-  *re = pcre2_compile((PCRE2_SPTR)regex.address, regex.length, compile_options, &error_number, &error_offset, NULL);
-  if (!*re) {
-    error_append(error, " at offset %d: ", (int)error_offset);
-    error_append_pcre_message(error, error_number);
-    return ERROR_FAIL(E_PATTERN);
+  char *p = input->address;
+  char *q = p + input->length;
+  int n = 0;
+  while (p < q && isdigit(*p)) {
+    n *= 10;
+    n += *p - '0';
+    p++;
+  }
+  if (p < q) {
+    return FAIL;
   }
+  *result = n;
   return OK;
 }
 
-EXPORT gtm_string_t *replace(int argc, input_t *text, input_t *search, input_t *replace) {
-  error_t *error = &last_error;
-  clear_error(error, __func__);
-  clear_context(&match_context);
-  if (argc < 1) {
-    return empty_string(error);
+// Digits only, up to limit
+static int parse_long(input_t *input, long *result, long limit) {
+  char *p = input->address;
+  char *q = p + input->length;
+  long n = 0;
+  while (p < q && isdigit(*p)) {
+    n = n * 10 + (*p - '0');
+    if (n > limit) {
+      return FAIL;
+    }
+    p++;
   }
-  if (argc < 2) {
-    return copy(error, text);
+  if (p < q) {
+    return FAIL;
   }
-  regex_opts_t opts;
-  pcre2_code *re;
-  if (!regex_compile(error, &re, &opts, search)) {
-    return NULL;
+  *result = n;
+  return OK;
+}
+
+static int mem_eq(char *a, int a_length, char *b, int b_length) {
+  if (a_length != b_length) {
+    return -1;
   }
-  if (argc < 3) {
-    pcre2_code_free(re);              
-    return copy(error, text);
+  return memcmp(a, b, a_length);
+}
+
+static uint32_t hash_mem(char *address, int length) {
+  uint32_t hash = 2166136261u;  // FNV-1a
+  for (int i = 0; i < length; i++) {
+    hash ^= (unsigned char)address[i];
+    hash *= 16777619u;
   }
-  int substitute_options = 0;
-  if (opts.g) {
-    substitute_options |= PCRE2_SUBSTITUTE_GLOBAL;
+  return hash;
+}
+
+static void pattern_free(pattern_t *pattern) {
+  pcre2_code_free(pattern->re);
+  free(pattern->names.slots);
+  free(pattern);
+}
+
+static void pattern_release(pattern_t *pattern) {
+  if (--pattern->refs == 0 && !pattern->cached) {
+    pattern_free(pattern);
   }
-  pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(re, NULL);  // do it here or pcre2_substitute will do it twice
-  PCRE2_SIZE length = 0;
-  int rc = pcre2_substitute(re, (PCRE2_SPTR)text->address, text->length, 0, substitute_options | PCRE2_SUBSTITUTE_OVERFLOW_LENGTH, match_data, NULL, (PCRE2_SPTR)replace->address, replace->length, NULL, &length);
-  if (rc != PCRE2_ERROR_NOMEMORY) {
-    pcre2_match_data_free(match_data);
-    pcre2_code_free(re);              
-    error_append_pcre_message(error, rc);
-    return ERROR_NULL(E_SUBST);
+}
+
+static void cache_unlink(pattern_t *pattern) {
+  pattern_t **p = &cache.buckets[pattern->hash & cache.mask];
+  while (*p != pattern) {
+    p = &(*p)->chain;
   }
-  if (length > MSTR_LIMIT) {
-    pcre2_match_data_free(match_data);
-    pcre2_code_free(re);              
-    return ERROR_NULL(E_LIMIT);
+  *p = pattern->chain;
+  if (pattern->prev) {
+    pattern->prev->next = pattern->next;
+  } else {
+    cache.head = pattern->next;
   }
-  output_t *output = gtm_malloc(sizeof(*output));
-  output->address = gtm_malloc(length);
-  if (!output->address) {
-    pcre2_match_data_free(match_data);
-    pcre2_code_free(re);              
-    return ERROR_NULL(E_MEM);
+  if (pattern->next) {
+    pattern->next->prev = pattern->prev;
+  } else {
+    cache.tail = pattern->prev;
   }
-  rc = pcre2_substitute(re, (PCRE2_SPTR)text->address, text->length, 0, substitute_options, match_data, NULL, (PCRE2_SPTR)replace->address, replace->length, (PCRE2_UCHAR8*)output->address, &length);
-  output->length = length;
-  pcre2_match_data_free(match_data);
-  pcre2_code_free(re);              
-  if (rc < 0) {
-    gtm_free(output->address);
-    gtm_free(output);
-    error_append_pcre_message(error, rc);
-    return ERROR_NULL(E_SUBST);
+  cache.count--;
+  cache.used -= pattern->size;
+  pattern->cached = 0;
+  if (!pattern->refs) {
+    pattern_free(pattern);
   }
-  return output;
 }
 
-EXPORT gtm_string_t *test(int argc, input_t *text, input_t *search) {
-  error_t *error = &last_error;
-  clear_error(error, __func__);
-  clear_context(&match_context);
-  if (argc < 2) {
-    return int_string(error, 0);
+static void cache_push(pattern_t *pattern) {
+  pattern->prev = NULL;
+  pattern->next = cache.head;
+  if (cache.head) {
+    cache.head->prev = pattern;
+  } else {
+    cache.tail = pattern;
   }
-  input_t null = { .address = "", .length = 0 };
-  if (!text->address) {
-    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  cache.head = pattern;
+}
+
+static void cache_trim(void) {
+  while (cache.tail && (cache.count > cache.size || cache.used > cache.memory)) {
+    cache_unlink(cache.tail);
   }
-  regex_opts_t opts;
-  pcre2_code *re;
-  if (!regex_compile(error, &re, &opts, search)) {
-    return NULL;
+}
+
+static int cache_resize(int size, long memory) {
+  while (cache.head) {
+    cache_unlink(cache.head);
   }
-  pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(re, NULL);
-  int rc = pcre2_match(re, (PCRE2_SPTR)text->address, text->length, 0, 0, match_data, NULL);
-  if (rc < 0) {
-    pcre2_match_data_free(match_data);
-    pcre2_code_free(re);              
-    if (rc == PCRE2_ERROR_NOMATCH) {
-      return int_string(error, 0);
-    }
-    error_append_pcre_message(error, rc);
-    return ERROR_NULL(E_MATCH);
+  free(cache.buckets);
+  cache.buckets = NULL;
+  cache.mask = 0;
+  cache.size = size;
+  cache.memory = memory;
+  if (!size) {
+    return OK;
   }
-  if (!opts.g) {
-    pcre2_match_data_free(match_data);
-    pcre2_code_free(re);              
-    return int_string(error, 1);
+  uint32_t buckets = 16;
+  while (buckets < (uint32_t)size * 2) {
+    buckets <<= 1;
   }
-  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-  uint32_t option_bits;
-  pcre2_pattern_info(re, PCRE2_INFO_ALLOPTIONS, &option_bits);
-  int utf8 = (option_bits & PCRE2_UTF) != 0;
-  uint32_t newline;
-  int crlf = 0;
-  pcre2_pattern_info(re, PCRE2_INFO_NEWLINE, &newline);
-  switch (newline) {
-    case PCRE2_NEWLINE_ANY:
-    case PCRE2_NEWLINE_CRLF:
-    case PCRE2_NEWLINE_ANYCRLF:
-      crlf = 1;
+  cache.buckets = calloc(buckets, sizeof(*cache.buckets));
+  if (!cache.buckets) {
+    cache.size = 0;
+    return FAIL;
   }
-  int count = 1;
-  for (;;) {
-    uint32_t match_options = 0;
-    PCRE2_SIZE offset = ovector[1];
-    if (ovector[0] == ovector[1]) {
-      if ((int)ovector[0] == text->length) {
-        break;
-      }
-      match_options = PCRE2_NOTEMPTY_ATSTART | PCRE2_ANCHORED;
-    }
-    int rc = pcre2_match(re, (PCRE2_SPTR)text->address, text->length, offset, match_options, match_data, NULL);
-    if (rc == PCRE2_ERROR_NOMATCH) {
-      if (!match_options) {
-        break;
-      }
-      ovector[1] = offset + 1;
-      if (crlf && (int)offset < text->length - 1 && text->address[offset] == '\r' && text->address[offset + 1] == '\n') {
-        ovector[1]++;
-      } else if (utf8) {
-        while ((int)ovector[1] < text->length) {
-          if ((text->address[ovector[1]] & 0xc0) != 0x80) {
-            break;
-          }
-          ovector[1]++;
-        }
-      }
-      continue;
-    }
-    if (rc < 0) {
-      pcre2_match_data_free(match_data);
-      pcre2_code_free(re);
-      error_append_pcre_message(error, rc);
-      return ERROR_NULL(E_MATCH);
+  cache.mask = buckets - 1;
+  return OK;
+}
+
+static long env_long(char *name, long value, long limit) {
+  char *s = getenv(name);
+  if (s && *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (!*end && n >= 0 && n <= limit) {
+      return n;
     }
-    count++;
   }
-  pcre2_match_data_free(match_data);
-  pcre2_code_free(re);
-  return int_string(error, count);
+  return value;
 }
 
-static void store_mem(char **begin, char *address, int length, int write) {
-  char *p = *begin;
-  if (write) {
-    memcpy(p, address, length);
-  }
-  p += length;
-  *begin = p;
+static void cache_init(void) {
+  cache.initialized = 1;
+  cache_resize(env_long("pcre_cache_size", CACHE_SIZE, CACHE_SIZE_MAX), env_long("pcre_cache_memory", CACHE_MEMORY, CACHE_MEMORY_MAX));
 }
 
-static void store_int(char **begin, int n, int write) {
-  char str[11];  // -2,147,483,648
-  char *p = str;
-  put_int(&p, n);
-  store_mem(begin, str, p - str, write);
+static void cache_touch(pattern_t *pattern) {
+  if (pattern == cache.head) {
+    return;
+  }
+  pattern->prev->next = pattern->next;
+  if (pattern->next) {
+    pattern->next->prev = pattern->prev;
+  } else {
+    cache.tail = pattern->prev;
+  }
+  cache_push(pattern);
 }
 
-static void store_vec(char **begin, PCRE2_SIZE *ovector, int i, input_t *sep, int write) {
-  char *p = *begin;
-  store_int(&p, ovector[2*i] + 1, write);  // first M index
-  store_mem(&p, sep->address, sep->length, write);
-  store_int(&p, ovector[2*i+1], write);    // last M index
-  *begin = p;
+static pattern_t *cache_lookup(input_t *search, uint32_t hash) {
+  for (pattern_t *pattern = cache.buckets[hash & cache.mask]; pattern; pattern = pattern->chain) {
+    if (pattern->hash == hash && !mem_eq(pattern->key, pattern->length, search->address, search->length)) {
+      cache_touch(pattern);
+      return pattern;
+    }
+  }
+  return NULL;
 }
 
-static void ovector2vec(output_t *output, PCRE2_SIZE *ovector, int i, input_t *sep) {
-  int write = output->address != NULL;
-  char *p = output->address;
-  store_vec(&p, ovector, i, sep, write);
-  output->length = p - output->address;
+static void cache_insert(pattern_t *pattern) {
+  if (pattern->size > cache.memory) {
+    return;
+  }
+  pattern_t **bucket = &cache.buckets[pattern->hash & cache.mask];
+  pattern->chain = *bucket;
+  *bucket = pattern;
+  cache_push(pattern);
+  pattern->cached = 1;
+  cache.count++;
+  cache.used += pattern->size;
+  cache_trim();
 }
 
-static void ovector2record(output_t *output, int groups, int matches, PCRE2_SIZE *ovector, input_t *text, input_t *sep, int all, int vector) {
-  int write = output->address != NULL;
-  char *p = output->address;
-  int first = all ? 0 : 1;
-  for (int i = first; i < groups + 1; i++) {
-    if (i > first) {
-      store_mem(&p, sep->address, sep->length, write);
+#define MEMORY_CLASSES 13      // blocks of 64 bytes to 256KiB, larger ones go straight to malloc()
+#define MEMORY_KEEP 1048576    // bytes of free blocks kept per class
+#define MATCH_DATA_CLASSES 8   // match data for up to 128 pairs, larger ones aren't pooled
+#define MATCH_DATA_KEEP 8
+
+typedef union block {
+  union block *next;  // while free
+  int size_class;     // while allocated, -1 when not pooled
+  max_align_t align;
+} block_t;
+
+// Free lists by size class behind every PCRE2 allocation, shared by the scan workers
+static struct {
+  pthread_mutex_t mutex;
+  block_t *blocks[MEMORY_CLASSES];
+  int count[MEMORY_CLASSES];
+  pcre2_general_context *general;
+  pcre2_compile_context *compile;
+} memory = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// Free match data by ovector size (pairs rounded up to a power of 2), only used on the calling thread
+static struct {
+  pcre2_match_data *data[MATCH_DATA_CLASSES][MATCH_DATA_KEEP];
+  int count[MATCH_DATA_CLASSES];
+} match_pool;
+
+static void *memory_malloc(PCRE2_SIZE size, UNUSED void *data) {
+  int size_class = 0;
+  while (size_class < MEMORY_CLASSES && (64UL << size_class) < size + sizeof(block_t)) {
+    size_class++;
+  }
+  block_t *block = NULL;
+  if (size_class < MEMORY_CLASSES) {
+    pthread_mutex_lock(&memory.mutex);
+    block = memory.blocks[size_class];
+    if (block) {
+      memory.blocks[size_class] = block->next;
+      memory.count[size_class]--;
     }
-    if (vector) {
-      if (i < matches && ovector[2*i] != PCRE2_UNSET) {
-        store_vec(&p, ovector, i, sep, write);
-      } else {
-        store_mem(&p, sep->address, sep->length, write);
-      }
-    } else {
-      if (i < matches) {
-        char *address = text->address + ovector[2*i];
-        int length = ovector[2*i+1] - ovector[2*i];
-        store_mem(&p, address, length, write);
-      }
+    pthread_mutex_unlock(&memory.mutex);
+    if (!block) {
+      block = malloc(64UL << size_class);
     }
+  } else {
+    block = malloc(size + sizeof(block_t));
+    size_class = -1;
   }
-  output->length = p - output->address;
+  if (!block) {
+    return NULL;
+  }
+  block->size_class = size_class;
+  return block + 1;
 }
 
-static output_t *match_record(error_t *error, context_t *context) {
-  int matches = (int)pcre2_get_ovector_count(context->data);
-  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(context->data);
-  output_t *output = gtm_malloc(sizeof(*output));
-  if (!output) {
-    return ERROR_NULL(E_MEM);
+static void memory_free(void *address, UNUSED void *data) {
+  if (!address) {
+    return;
   }
-  output->address = NULL;
-  ovector2record(output, context->groups, matches, ovector, &context->text, &context->sep, context->all, context->vector);
-  output->address = gtm_malloc(max(output->length, 1));
-  if (!output->address) {
-    return ERROR_NULL(E_MEM);
+  block_t *block = (block_t *)address - 1;
+  int size_class = block->size_class;
+  if (size_class >= 0) {
+    pthread_mutex_lock(&memory.mutex);
+    if (memory.count[size_class] < max(MEMORY_KEEP >> (6 + size_class), 1)) {
+      block->next = memory.blocks[size_class];
+      memory.blocks[size_class] = block;
+      memory.count[size_class]++;
+      block = NULL;
+    }
+    pthread_mutex_unlock(&memory.mutex);
   }
-  ovector2record(output, context->groups, matches, ovector, &context->text, &context->sep, context->all, context->vector);
-  return output;
+  free(block);
 }
 
-EXPORT gtm_string_t *match(int argc, input_t *text, input_t *search, input_t *sep) {
-  error_t *error = &last_error;
-  clear_error(error, __func__);
-  context_t *context = &match_context;
-  clear_context(context);
-  if (argc < 1) {
-    return empty_string(error);
+// Without the contexts PCRE2 falls back to malloc()
+static void memory_init(void) {
+  memory.general = pcre2_general_context_create(memory_malloc, memory_free, NULL);
+  if (memory.general) {
+    memory.compile = pcre2_compile_context_create(memory.general);
   }
-  if (argc < 2) {
-    return copy(error, text);
+}
+
+static int match_data_class(uint32_t pairs) {
+  int size_class = 0;
+  while (size_class < MATCH_DATA_CLASSES && (1U << size_class) < pairs) {
+    size_class++;
   }
+  return size_class;
+}
+
+// Match data with at least the ovector pairs of the pattern, from the pool when possible
+static pcre2_match_data *match_data_get(pcre2_code *re) {
+  uint32_t groups;
+  pcre2_pattern_info(re, PCRE2_INFO_CAPTURECOUNT, &groups);
+  int size_class = match_data_class(groups + 1);
+  if (size_class == MATCH_DATA_CLASSES) {
+    return pcre2_match_data_create_from_pattern(re, memory.general);
+  }
+  if (match_pool.count[size_class]) {
+    return match_pool.data[size_class][--match_pool.count[size_class]];
+  }
+  return pcre2_match_data_create(1U << size_class, memory.general);
+}
+
+static void match_data_put(pcre2_match_data *data) {
+  if (!data) {
+    return;
+  }
+  uint32_t pairs = pcre2_get_ovector_count(data);
+  int size_class = match_data_class(pairs);
+  if (size_class < MATCH_DATA_CLASSES && pairs == 1U << size_class && match_pool.count[size_class] < MATCH_DATA_KEEP) {
+    match_pool.data[size_class][match_pool.count[size_class]++] = data;
+    return;
+  }
+  pcre2_match_data_free(data);
+}
+
+#define JIT_THRESHOLD 4
+#define JIT_STACK_SIZE 131072
+#define JIT_STACK_MAX 67108864
+
+// Match context with its own JIT stack, one per thread matching at the same time
+typedef struct {
+  pcre2_match_context *context;
+  pcre2_jit_stack *stack;
+  long size;
+  long deadline;  // CLOCK_MONOTONIC nanoseconds, with a timeout
+  unsigned int callouts;
+} matcher_t;
+
+typedef struct {
+  int initialized;
+  int available;
+  int threshold;  // uses of a cached pattern before it is JIT-compiled, 0 disables
+  long max;
+  matcher_t matcher;
+} jit_t;
+
+static jit_t jit;
+
+// Patterns from the $pcre_preload manifest, loaded on first use
+static struct {
+  int initialized;
+  int count;
+} preload;
+
+#define MATCH_LIMIT 10000000
+#define DEPTH_LIMIT 10000000
+#define HEAP_LIMIT 20000000  // KiB
+#define TIMEOUT_CHECK 256    // callouts between clock readings
+
+// PCRE2 resource limits and a wall-clock limit for every match (milliseconds, 0 is none)
+static struct {
+  int match;
+  int depth;
+  int heap;
+  int timeout;
+} limits;
+
+static long clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Patterns are compiled with PCRE2_AUTO_CALLOUT while there is a timeout
+static int deadline_callout(UNUSED pcre2_callout_block *block, void *data) {
+  matcher_t *matcher = data;
+  if (!limits.timeout || ++matcher->callouts % TIMEOUT_CHECK || clock_ns() < matcher->deadline) {
+    return 0;
+  }
+  return PCRE2_ERROR_CALLOUT;
+}
+
+static void matcher_deadline(matcher_t *matcher) {
+  if (limits.timeout) {
+    matcher->deadline = clock_ns() + limits.timeout * 1000000L;
+    matcher->callouts = 0;
+  }
+}
+
+static void matcher_limits(matcher_t *matcher) {
+  pcre2_set_match_limit(matcher->context, limits.match);
+  pcre2_set_depth_limit(matcher->context, limits.depth);
+  pcre2_set_heap_limit(matcher->context, limits.heap);
+  pcre2_set_callout(matcher->context, deadline_callout, matcher);
+}
+
+static int matcher_stack(matcher_t *matcher, long size) {
+  pcre2_jit_stack *stack = pcre2_jit_stack_create(size, size, memory.general);
+  if (!stack) {
+    return FAIL;
+  }
+  pcre2_jit_stack_assign(matcher->context, NULL, stack);
+  if (matcher->stack) {
+    pcre2_jit_stack_free(matcher->stack);
+  }
+  matcher->stack = stack;
+  matcher->size = size;
+  return OK;
+}
+
+static void jit_init(void) {
+  jit.initialized = 1;
+  uint32_t available = 0;
+  pcre2_config(PCRE2_CONFIG_JIT, &available);
+  jit.threshold = env_long("pcre_jit_threshold", JIT_THRESHOLD, 1 << 30);
+  jit.max = env_long("pcre_jit_stack_max", JIT_STACK_MAX, 1L << 32);
+  limits.match = env_long("pcre_match_limit", MATCH_LIMIT, INT_MAX);
+  limits.depth = env_long("pcre_depth_limit", DEPTH_LIMIT, INT_MAX);
+  limits.heap = env_long("pcre_heap_limit", HEAP_LIMIT, INT_MAX);
+  limits.timeout = env_long("pcre_timeout", 0, 1000000000);
+  memory_init();
+  jit.matcher.context = pcre2_match_context_create(memory.general);
+  if (jit.matcher.context) {
+    matcher_limits(&jit.matcher);
+  }
+  if (!jit.matcher.context || !available) {
+    return;
+  }
+  jit.available = matcher_stack(&jit.matcher, min((long)JIT_STACK_SIZE, jit.max));
+}
+
+// Copies the settings of the shared match context, the JIT stack starts small again
+static int matcher_init(matcher_t *matcher) {
+  memset(matcher, '\0', sizeof(*matcher));
+  matcher->context = pcre2_match_context_create(memory.general);
+  if (!matcher->context) {
+    return FAIL;
+  }
+  matcher_limits(matcher);
+  if (jit.available && !matcher_stack(matcher, min((long)JIT_STACK_SIZE, jit.max))) {
+    pcre2_match_context_free(matcher->context);
+    return FAIL;
+  }
+  return OK;
+}
+
+static void matcher_free(matcher_t *matcher) {
+  if (matcher->stack) {
+    pcre2_jit_stack_free(matcher->stack);
+  }
+  pcre2_match_context_free(matcher->context);
+}
+
+static int jit_stack_grow(matcher_t *matcher) {
+  if (!matcher->stack || matcher->size >= jit.max) {
+    return FAIL;
+  }
+  return matcher_stack(matcher, min(matcher->size * 2, jit.max));
+}
+
+static char *names_entry(names_t *names, uint32_t j, int *number) {
+  unsigned char *p = (unsigned char *)names->table + j * names->entry_size;
+  *number = (p[0] << 8) | p[1];
+  return (char *)p + 2;  // IMM2_SIZE
+}
+
+// Duplicate names (?J) keep their first entry, like pcre2_substring_number_from_name()
+static void names_build(pattern_t *pattern) {
+  names_t *names = &pattern->names;
+  names->built = 1;
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_NAMECOUNT, &names->count);
+  if (!names->count) {
+    return;
+  }
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_NAMETABLE, &names->table);
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_NAMEENTRYSIZE, &names->entry_size);
+  uint32_t size = 16;
+  while (size < names->count * 2) {
+    size <<= 1;
+  }
+  names->slots = calloc(size, sizeof(*names->slots));
+  if (!names->slots) {
+    return;  // names_lookup() falls back to scanning the table
+  }
+  names->mask = size - 1;
+  for (uint32_t j = 0; j < names->count; j++) {
+    int number;
+    char *name = names_entry(names, j, &number);
+    int length = strlen(name);
+    uint32_t k = hash_mem(name, length) & names->mask;
+    while (names->slots[k]) {
+      char *other = names_entry(names, names->slots[k] - 1, &number);
+      if (!mem_eq(other, strlen(other), name, length)) {
+        break;
+      }
+      k = (k + 1) & names->mask;
+    }
+    if (!names->slots[k]) {
+      names->slots[k] = j + 1;
+    }
+  }
+  pattern->size += size * sizeof(*names->slots);
+  if (pattern->cached) {
+    cache.used += size * sizeof(*names->slots);
+    cache_trim();
+  }
+}
+
+static int names_lookup(pattern_t *pattern, input_t *name, int *i) {
+  names_t *names = &pattern->names;
+  if (!names->built) {
+    names_build(pattern);
+  }
+  if (!names->slots) {
+    for (uint32_t j = 0; j < names->count; j++) {
+      char *entry = names_entry(names, j, i);
+      if (!mem_eq(entry, strlen(entry), name->address, name->length)) {
+        return OK;
+      }
+    }
+    return FAIL;
+  }
+  for (uint32_t k = hash_mem(name->address, name->length) & names->mask; names->slots[k]; k = (k + 1) & names->mask) {
+    char *entry = names_entry(names, names->slots[k] - 1, i);
+    if (!mem_eq(entry, strlen(entry), name->address, name->length)) {
+      return OK;
+    }
+  }
+  return FAIL;
+}
+
+static void pattern_jit(pattern_t *pattern) {
+  if (!jit.available || pcre2_jit_compile(pattern->re, PCRE2_JIT_COMPLETE) < 0) {
+    return;
+  }
+  pattern->jit = 1;
+  size_t size;
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_JITSIZE, &size);
+  pattern->size += size;
+  if (pattern->cached) {
+    cache.used += size;
+    cache_trim();
+  }
+}
+
+#define tolower_ascii(c) \
+  ({ __typeof__ (c) _c = (c); \
+     _c >= 'A' && _c <= 'Z' ? _c + ('a' - 'A') : _c; })
+
+#define toupper_ascii(c) \
+  ({ __typeof__ (c) _c = (c); \
+     _c >= 'a' && _c <= 'z' ? _c - ('a' - 'A') : _c; })
+
+static long (*literal_search)(literal_t *literal, char *text, long length);
+
+static int literal_equal(literal_t *literal, char *text) {
+  if (!literal->caseless) {
+    return !memcmp(text, literal->address, literal->length);
+  }
+  for (int i = 0; i < literal->length; i++) {
+    if (tolower_ascii((unsigned char)text[i]) != tolower_ascii((unsigned char)literal->address[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static long literal_search_scalar(literal_t *literal, char *text, long length) {
+  if (!literal->caseless) {
+    char *p = memmem(text, length, literal->address, literal->length);
+    return p ? p - text : -1;
+  }
+  long last = literal->length - 1;
+  for (long i = 0; i + last < length; i++) {
+    unsigned char c = text[i];
+    if ((c == literal->first[0] || c == literal->first[1]) && literal_equal(literal, text + i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+#if defined(__x86_64__)
+
+// Candidates are positions where both the first and the last byte of the literal match,
+// 16 (SSE2) or 32 (AVX2) of them are checked at once
+static long literal_search_sse2(literal_t *literal, char *text, long length) {
+  long last = literal->length - 1;
+  __m128i first0 = _mm_set1_epi8(literal->first[0]);
+  __m128i first1 = _mm_set1_epi8(literal->first[1]);
+  __m128i last0 = _mm_set1_epi8(literal->last[0]);
+  __m128i last1 = _mm_set1_epi8(literal->last[1]);
+  long i = 0;
+  for (; i + last + 16 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((__m128i*)(text + i));
+    __m128i b = _mm_loadu_si128((__m128i*)(text + i + last));
+    __m128i first = _mm_or_si128(_mm_cmpeq_epi8(a, first0), _mm_cmpeq_epi8(a, first1));
+    __m128i end = _mm_or_si128(_mm_cmpeq_epi8(b, last0), _mm_cmpeq_epi8(b, last1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(first, end));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (literal_equal(literal, text + i + bit)) {
+        return i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+  long found = literal_search_scalar(literal, text + i, length - i);
+  return found < 0 ? -1 : i + found;
+}
+
+__attribute__((target("avx2")))
+static long literal_search_avx2(literal_t *literal, char *text, long length) {
+  long last = literal->length - 1;
+  __m256i first0 = _mm256_set1_epi8(literal->first[0]);
+  __m256i first1 = _mm256_set1_epi8(literal->first[1]);
+  __m256i last0 = _mm256_set1_epi8(literal->last[0]);
+  __m256i last1 = _mm256_set1_epi8(literal->last[1]);
+  long i = 0;
+  for (; i + last + 32 <= length; i += 32) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(text + i));
+    __m256i b = _mm256_loadu_si256((__m256i*)(text + i + last));
+    __m256i first = _mm256_or_si256(_mm256_cmpeq_epi8(a, first0), _mm256_cmpeq_epi8(a, first1));
+    __m256i end = _mm256_or_si256(_mm256_cmpeq_epi8(b, last0), _mm256_cmpeq_epi8(b, last1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(first, end));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (literal_equal(literal, text + i + bit)) {
+        return i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+  long found = literal_search_sse2(literal, text + i, length - i);
+  return found < 0 ? -1 : i + found;
+}
+
+static int is_ascii(char *text, long length) {
+  long i = 0;
+  for (; i + 16 <= length; i += 16) {
+    if (_mm_movemask_epi8(_mm_loadu_si128((__m128i*)(text + i)))) {
+      return 0;
+    }
+  }
+  for (; i < length; i++) {
+    if (text[i] & 0x80) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#else
+
+static int is_ascii(char *text, long length) {
+  for (long i = 0; i < length; i++) {
+    if (text[i] & 0x80) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#endif
+
+static void literal_search_init(void) {
+  if (!literal_search) {
+    literal_search = literal_search_scalar;
+#if defined(__x86_64__)
+    literal_search = __builtin_cpu_supports("avx2") ? literal_search_avx2 : literal_search_sse2;
+#endif
+  }
+}
+
+static void literal_init(pattern_t *pattern, int offset, int length) {
+  regex_opts_t *opts = &pattern->opts;
+  if (!length || opts->x || (opts->i && !opts->z)) {  // caseless UTF matching folds more than ASCII
+    return;
+  }
+  char *regex = pattern->key + offset;
+  for (int i = 0; i < length; i++) {
+    if (strchr("\\^$.|?*+()[]{}", regex[i]) && regex[i]) {
+      return;
+    }
+  }
+  literal_search_init();
+  literal_t *literal = &pattern->literal;
+  literal->address = regex;
+  literal->length = length;
+  literal->caseless = opts->i;
+  unsigned char first = regex[0];
+  unsigned char last = regex[length - 1];
+  literal->first[0] = literal->caseless ? tolower_ascii(first) : first;
+  literal->first[1] = literal->caseless ? toupper_ascii(first) : first;
+  literal->last[0] = literal->caseless ? tolower_ascii(last) : last;
+  literal->last[1] = literal->caseless ? toupper_ascii(last) : last;
+}
+
+// Same result as PCRE2 for subjects it would accept, FAIL leaves them to PCRE2 (with its UTF error)
+static int literal_match(pattern_t *pattern, input_t *text, PCRE2_SIZE offset, uint32_t options, pcre2_match_data *data, int *rc) {
+  if (options & PCRE2_ANCHORED || offset > (PCRE2_SIZE)text->length) {
+    return FAIL;
+  }
+  if (pattern->utf8 && !(options & PCRE2_NO_UTF_CHECK) && !is_ascii(text->address, text->length)) {
+    return FAIL;
+  }
+  long found = literal_search(&pattern->literal, text->address + offset, text->length - offset);
+  if (found < 0) {
+    *rc = PCRE2_ERROR_NOMATCH;
+    return OK;
+  }
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(data);
+  ovector[0] = offset + found;
+  ovector[1] = ovector[0] + pattern->literal.length;
+  *rc = 1;
+  return OK;
+}
+
+// The caseless flag of the first and last code units is not exposed, so ASCII letters are looked for
+// in both cases when any part of the pattern may be caseless, PCRE2 drops units with other cases outside ASCII
+static void prefilter_add(prefilter_t *prefilter, uint32_t unit, int caseless) {
+  unsigned char c = unit;
+  for (int i = 0; i < prefilter->units; i++) {
+    if (prefilter->required[i].first[0] == (caseless ? tolower_ascii(c) : c)) {
+      return;
+    }
+  }
+  int i = prefilter->units++;
+  prefilter->unit[i] = c;
+  literal_t *literal = &prefilter->required[i];
+  literal->address = &prefilter->unit[i];
+  literal->length = 1;
+  literal->caseless = caseless;
+  literal->first[0] = literal->last[0] = caseless ? tolower_ascii(c) : c;
+  literal->first[1] = literal->last[1] = caseless ? toupper_ascii(c) : c;
+}
+
+// Inline option setting such as (?i) or (?-i) anywhere in the regex
+static int regex_inline_option(char *regex, int length, char option) {
+  for (char *p = regex, *end = regex + length; (p = memmem(p, end - p, "(?", 2)); ) {
+    for (p += 2; p < end && (isalpha(*p) || *p == '-' || *p == '^'); p++) {
+      if (*p == option) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// 'i' or an inline option setting (?i) or (?-i)
+static int regex_caseless(pattern_t *pattern, char *regex, int length) {
+  return pattern->opts.i || regex_inline_option(regex, length, 'i');
+}
+
+static void prefilter_init(pattern_t *pattern, int offset, int length) {
+  prefilter_t *prefilter = &pattern->prefilter;
+  int caseless = regex_caseless(pattern, pattern->key + offset, length);
+  uint32_t type, unit, options;
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_MINLENGTH, &prefilter->length);
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_ALLOPTIONS, &options);
+  if (options & PCRE2_ANCHORED) {
+    // matches only at the offset, searching the rest of the subject for units would cost more than
+    // the match, and be repeated by every call of a loop stepping through the subject (lex())
+    prefilter->enabled = prefilter->length > 0;
+    return;
+  }
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_FIRSTCODETYPE, &type);
+  if (type == 1) {
+    pcre2_pattern_info(pattern->re, PCRE2_INFO_FIRSTCODEUNIT, &unit);
+    prefilter_add(prefilter, unit, caseless);
+  }
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_LASTCODETYPE, &type);
+  if (type == 1) {
+    pcre2_pattern_info(pattern->re, PCRE2_INFO_LASTCODEUNIT, &unit);
+    prefilter_add(prefilter, unit, caseless);
+  }
+  const uint8_t *bitmap;
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_FIRSTBITMAP, &bitmap);
+  if (bitmap) {
+    prefilter->bitmap = 1;
+    memcpy(prefilter->first, bitmap, sizeof(prefilter->first));
+  }
+  prefilter->enabled = prefilter->length || prefilter->units || prefilter->bitmap;
+  if (prefilter->enabled) {
+    literal_search_init();
+  }
+}
+
+// OK when the subject can't match from offset, without running PCRE2 (or validating UTF-8,
+// so for UTF patterns only subjects already validated or plain ASCII are rejected)
+static int prefilter_reject(pattern_t *pattern, input_t *text, PCRE2_SIZE offset, uint32_t options) {
+  prefilter_t *prefilter = &pattern->prefilter;
+  if (offset > (PCRE2_SIZE)text->length) {
+    return FAIL;
+  }
+  char *address = text->address + offset;
+  long length = text->length - offset;
+  if (length >= prefilter->length && !prefilter->units && !prefilter->bitmap) {
+    return FAIL;
+  }
+  if (pattern->utf8 && !(options & PCRE2_NO_UTF_CHECK) && !is_ascii(text->address, text->length)) {
+    return FAIL;
+  }
+  if (length < prefilter->length) {
+    return OK;
+  }
+  for (int i = 0; i < prefilter->units; i++) {
+    if (literal_search(&prefilter->required[i], address, length) < 0) {
+      return OK;
+    }
+  }
+  if (prefilter->bitmap) {
+    for (long i = 0; i < length; i++) {
+      unsigned char c = address[i];
+      if (prefilter->first[c >> 3] & (1 << (c & 7))) {
+        return FAIL;
+      }
+    }
+    return OK;
+  }
+  return FAIL;
+}
+
+// pcre2_jit_match() skips UTF validation and does not support PCRE2_ANCHORED
+static int matcher_match(matcher_t *matcher, pattern_t *pattern, input_t *text, PCRE2_SIZE offset, uint32_t options, pcre2_match_data *data) {
+  int rc;
+  if (pattern->literal.length && literal_match(pattern, text, offset, options, data, &rc)) {
+    return rc;
+  }
+  if (pattern->prefilter.enabled && prefilter_reject(pattern, text, offset, options)) {
+    return PCRE2_ERROR_NOMATCH;
+  }
+  matcher_deadline(matcher);
+  PCRE2_SPTR subject = (PCRE2_SPTR)text->address;
+  for (;;) {
+    if (pattern->jit && !(options & PCRE2_ANCHORED) && (options & PCRE2_NO_UTF_CHECK || !pattern->utf8)) {
+      rc = pcre2_jit_match(pattern->re, subject, text->length, offset, options, data, matcher->context);
+    } else {
+      rc = pcre2_match(pattern->re, subject, text->length, offset, options, data, matcher->context);
+    }
+    if (rc != PCRE2_ERROR_JIT_STACKLIMIT || !jit_stack_grow(matcher)) {
+      return rc;
+    }
+  }
+}
+
+static int regex_match(pattern_t *pattern, input_t *text, PCRE2_SIZE offset, uint32_t options, pcre2_match_data *data) {
+  return matcher_match(&jit.matcher, pattern, text, offset, options, data);
+}
+
+// The whole subject is validated by the first pcre2_match() of a global loop, later calls
+// skip the check unless \C left the offset inside of a character (PCRE2 reports it then)
+static uint32_t utf_check_option(input_t *text, PCRE2_SIZE offset) {
+  if (offset < (PCRE2_SIZE)text->length && (text->address[offset] & 0xc0) == 0x80) {
+    return 0;
+  }
+  return PCRE2_NO_UTF_CHECK;
+}
+
+static pcre2_code *utf_probe;  // empty UTF pattern, matching it validates a subject
+
+// UTF-8 is validated once for a subject then matched with PCRE2_NO_UTF_CHECK (a set, a resumed global match)
+static int utf_validate(error_t *error, input_t *text, pcre2_match_data *data) {
+  if (!utf_probe) {
+    int error_number;
+    PCRE2_SIZE error_offset;
+    utf_probe = pcre2_compile((PCRE2_SPTR)"", 0, PCRE2_UTF, &error_number, &error_offset, memory.compile);
+    if (!utf_probe) {
+      return ERROR_FAIL(E_MEM);
+    }
+  }
+  int rc = pcre2_match(utf_probe, (PCRE2_SPTR)text->address, text->length, 0, 0, data, NULL);
+  if (rc < 0) {
+    return ERROR_FAIL(match_error(error, rc, E_MATCH));
+  }
+  return OK;
+}
+
+// Offset of the next character after an empty match which could not be extended
+static PCRE2_SIZE advance(input_t *text, PCRE2_SIZE offset, int utf8, int crlf) {
+  char *p = text->address + offset;
+  long remaining = text->length - offset;
+  if (crlf && remaining > 1 && p[0] == '\r' && p[1] == '\n') {
+    return offset + 2;
+  }
+  if (!utf8 || remaining < 2) {
+    return offset + 1;
+  }
+  unsigned char c = p[0];
+  if (c >= 0xc0) {  // lead byte of a validated subject gives the sequence length
+    return offset + min(c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4, remaining);
+  }
+  int n = 1;
+  while (n < remaining && (p[n] & 0xc0) == 0x80) {
+    n++;
+  }
+  return offset + n;
+}
+
+// Continues a global match after the one in the ovector, PCRE2_ERROR_NOMATCH when there are no more
+static int match_continue(pattern_t *pattern, input_t *text, pcre2_match_data *data) {
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(data);
+  for (;;) {
+    uint32_t match_options = 0;
+    PCRE2_SIZE offset = ovector[1];
+    if (ovector[0] == ovector[1]) {
+      if (ovector[0] == (PCRE2_SIZE)text->length) {
+        return PCRE2_ERROR_NOMATCH;
+      }
+      match_options = PCRE2_NOTEMPTY_ATSTART | PCRE2_ANCHORED;
+    }
+    int rc = regex_match(pattern, text, offset, match_options | utf_check_option(text, offset), data);
+    if (rc == PCRE2_ERROR_NOMATCH && match_options) {
+      ovector[0] = offset;
+      ovector[1] = advance(text, offset, pattern->utf8, pattern->crlf);
+      continue;
+    }
+    return rc;
+  }
+}
+
+static int pattern_compile(error_t *error, input_t *regex, regex_opts_t *opts, pcre2_code **re) {
+  uint32_t compile_options = regex_compile_options(opts);
+  if (limits.timeout) {
+    compile_options |= PCRE2_AUTO_CALLOUT;
+  }
+  int error_number;
+  PCRE2_SIZE error_offset;
+  *re = pcre2_compile((PCRE2_SPTR)regex->address, regex->length, compile_options, &error_number, &error_offset, memory.compile);
+  if (!*re) {
+    error_append(error, " at offset %d: ", (int)error_offset);
+    error_append_pcre_message(error, error_number);
+    return ERROR_FAIL(E_PATTERN);
+  }
+  return OK;
+}
+
+// Pattern for a compiled (or deserialized) regex, which is freed on errors
+static int pattern_create(error_t *error, pattern_t **result, input_t *search, input_t *regex, regex_opts_t *opts, pcre2_code *re, uint32_t hash) {
+  pattern_t *pattern = malloc(sizeof(*pattern) + search->length);
+  if (!pattern) {
+    pcre2_code_free(re);
+    return ERROR_FAIL(E_MEM);
+  }
+  memset(pattern, '\0', sizeof(*pattern));
+  pattern->re = re;
+  pattern->opts = *opts;
+  pattern->uses = 1;
+  pattern->refs = 1;
+  pattern->hash = hash;
+  pattern->length = search->length;
+  memcpy(pattern->key, search->address, search->length);
+  size_t size;
+  pcre2_pattern_info(re, PCRE2_INFO_SIZE, &size);
+  pattern->size = sizeof(*pattern) + search->length + size;
+  uint32_t options;
+  pcre2_pattern_info(re, PCRE2_INFO_ALLOPTIONS, &options);
+  pattern->utf8 = (options & PCRE2_UTF) != 0;
+  uint32_t newline;
+  pcre2_pattern_info(re, PCRE2_INFO_NEWLINE, &newline);
+  switch (newline) {
+    case PCRE2_NEWLINE_ANY:
+    case PCRE2_NEWLINE_CRLF:
+    case PCRE2_NEWLINE_ANYCRLF:
+      pattern->crlf = 1;
+  }
+  literal_init(pattern, regex->address - search->address, regex->length);
+  if (!pattern->literal.length) {
+    prefilter_init(pattern, regex->address - search->address, regex->length);
+  }
+  *result = pattern;
+  return OK;
+}
+
+static void preload_init(void);
+
+static int regex_compile(error_t *error, pattern_t **result, input_t *search) {
+  if (!cache.initialized) {
+    cache_init();
+  }
+  if (!jit.initialized) {
+    jit_init();
+  }
+  if (!preload.initialized) {
+    preload_init();
+  }
+  uint32_t hash = 0;
+  if (cache.size) {
+    hash = hash_mem(search->address, search->length);
+    pattern_t *pattern = cache_lookup(search, hash);
+    if (pattern) {
+      cache.hits++;
+      pattern->refs++;
+      if (++pattern->uses == jit.threshold && !pattern->jit) {
+        pattern_jit(pattern);
+      }
+      *result = pattern;
+      return OK;
+    }
+    cache.misses++;
+  }
+  input_t regex;
   regex_opts_t opts;
-  if (!regex_compile(error, &context->re, &opts, search)) {
+  pcre2_code *re;
+  pattern_t *pattern;
+  if (!parse_regex(error, &regex, search, &opts) || !pattern_compile(error, &regex, &opts, &re) || !pattern_create(error, &pattern, search, &regex, &opts, re, hash)) {
+    return FAIL;
+  }
+  if (opts.j || jit.threshold == 1) {
+    pattern_jit(pattern);
+  }
+  if (cache.size) {
+    cache_insert(pattern);
+  }
+  *result = pattern;
+  return OK;
+}
+
+EXPORT gtm_string_t *cache_control(int argc, input_t *size, input_t *memory) {
+  error_t *error = &last_error;
+  clear_error(error, "cache");
+  if (!cache.initialized) {
+    cache_init();
+  }
+  long n = cache.size;
+  long m = cache.memory;
+  int resize = 0;
+  // same limits as pcre_cache_size and pcre_cache_memory
+  if (argc >= 1 && size->length) {
+    if (!parse_long(size, &n, CACHE_SIZE_MAX)) {
+      return ERROR_NULL(E_ARG);
+    }
+    resize = 1;
+  }
+  if (argc >= 2 && memory->length) {
+    if (!parse_long(memory, &m, CACHE_MEMORY_MAX)) {
+      return ERROR_NULL(E_ARG);
+    }
+    resize = 1;
+  }
+  if (resize && !cache_resize(n, m)) {
+    return ERROR_NULL(E_MEM);
+  }
+  char text[128];
+  input_t input = { .address = text };
+  input.length = snprintf(text, sizeof(text), "%d,%ld,%d,%ld,%ld,%ld", cache.size, cache.memory, cache.count, cache.used, cache.hits, cache.misses);
+  return copy(error, &input);
+}
+
+// Empty arguments keep their limit, turning the timeout on or off flushes the pattern cache
+EXPORT gtm_string_t *limits_control(int argc, input_t *match, input_t *depth, input_t *heap, input_t *timeout) {
+  error_t *error = &last_error;
+  clear_error(error, "limits");
+  if (!jit.initialized) {
+    jit_init();
+  }
+  input_t *args[] = { match, depth, heap, timeout };
+  int values[] = { limits.match, limits.depth, limits.heap, limits.timeout };
+  for (int i = 0; i < argc && i < 4; i++) {
+    if (args[i]->length && !parse_int(args[i], &values[i], 9)) {
+      return ERROR_NULL(E_ARG);
+    }
+  }
+  int flush = !limits.timeout != !values[3];
+  limits.match = values[0];
+  limits.depth = values[1];
+  limits.heap = values[2];
+  limits.timeout = values[3];
+  if (jit.matcher.context) {
+    matcher_limits(&jit.matcher);
+  }
+  if (flush) {
+    if (!cache.initialized) {
+      cache_init();
+    }
+    if (!cache_resize(cache.size, cache.memory)) {
+      return ERROR_NULL(E_MEM);
+    }
+  }
+  char text[128];
+  input_t input = { .address = text };
+  input.length = snprintf(text, sizeof(text), "%d,%d,%d,%d", limits.match, limits.depth, limits.heap, limits.timeout);
+  return copy(error, &input);
+}
+
+typedef struct {
+  pattern_t *pattern;
+  pcre2_code *re;
+  uint32_t groups;
+  pcre2_match_data *data;
+  int all;
+  int vector;
+  input_t text;
+  input_t sep;
+  int text_size;
+  int sep_size;
+  int next;
+} context_t;
+
+static context_t match_context;
+
+// Drops the match, keeping match data and buffers for the next one
+static void release_context(context_t *context) {
+  if (context->re) {
+    pattern_release(context->pattern);
+  }
+  context_t kept = {
+    .data = context->data,
+    .text = { .address = context->text.address },
+    .sep = { .address = context->sep.address },
+    .text_size = context->text_size,
+    .sep_size = context->sep_size,
+  };
+  *context = kept;
+}
+
+static int copy_input(error_t *error, input_t *dst, int *size, input_t *src) {
+  if (!dst->address || *size < src->length) {
+    int size_new = max(min(*size * 2, MSTR_LIMIT), max(src->length, 1));  // subjects grow, don't copy at every size
+    free(dst->address);
+    *size = 0;
+    dst->address = malloc(size_new);
+    if (!dst->address) {
+      return ERROR_FAIL(E_MEM);
+    }
+    *size = size_new;
+  }
+  memcpy(dst->address, src->address, src->length);
+  dst->length = src->length;
+  return OK;
+}
+
+// Reused by every replace(), holds at most one M string
+static struct {
+  char *address;
+  PCRE2_SIZE size;
+} substitute_buffer;
+
+static int substitute_reserve(error_t *error, PCRE2_SIZE size) {
+  if (size <= substitute_buffer.size) {
+    return OK;
+  }
+  size = min(max(size, substitute_buffer.size * 2), (PCRE2_SIZE)MSTR_LIMIT + 1);
+  char *address = realloc(substitute_buffer.address, size);
+  if (!address) {
+    return ERROR_FAIL(E_MEM);
+  }
+  substitute_buffer.address = address;
+  substitute_buffer.size = size;
+  return OK;
+}
+
+// '$' is the only special character of a replacement, UTF-8 in either string is validated by PCRE2
+static int literal_substitute(pattern_t *pattern, input_t *text, input_t *replace) {
+  if (!pattern->literal.length || memchr(replace->address, '$', replace->length)) {
+    return 0;
+  }
+  return !pattern->utf8 || (is_ascii(replace->address, replace->length) && is_ascii(text->address, text->length));
+}
+
+static int literal_replace(error_t *error, pattern_t *pattern, input_t *text, input_t *replace, PCRE2_SIZE *result) {
+  literal_t *literal = &pattern->literal;
+  PCRE2_SIZE length = 0;
+  long offset = 0;
+  int replaced = 0;
+  for (;;) {
+    long found = replaced && !pattern->opts.g ? -1 : literal_search(literal, text->address + offset, text->length - offset);
+    long copy = found < 0 ? text->length - offset : found;
+    long size = length + copy + (found < 0 ? 0 : replace->length);
+    if (size > MSTR_LIMIT) {
+      return ERROR_FAIL(E_LIMIT);
+    }
+    if (!substitute_reserve(error, size + 1)) {
+      return FAIL;
+    }
+    memcpy(substitute_buffer.address + length, text->address + offset, copy);
+    length += copy;
+    if (found < 0) {
+      break;
+    }
+    memcpy(substitute_buffer.address + length, replace->address, replace->length);
+    length += replace->length;
+    offset += found + literal->length;
+    replaced = 1;
+  }
+  *result = length;
+  return OK;
+}
+
+// Text with the replacements in the substitute buffer
+static int pattern_substitute(error_t *error, pattern_t *pattern, input_t *text, input_t *replace, input_t *result) {
+  pcre2_code *re = pattern->re;
+  int substitute_options = 0;
+  if (pattern->opts.g) {
+    substitute_options |= PCRE2_SUBSTITUTE_GLOBAL;
+  }
+  pcre2_match_data *match_data = match_data_get(re);  // do it here or pcre2_substitute will do it twice
+  if (!match_data) {
+    return ERROR_FAIL(E_MEM);
+  }
+  // usually the result fits the buffer and the subject is scanned once, a second pass is only needed on overflow
+  int ok = FAIL;
+  PCRE2_SIZE length = 0;
+  int rc;
+  if (literal_substitute(pattern, text, replace)) {
+    ok = literal_replace(error, pattern, text, replace, &length);
+  } else {
+    for (;;) {
+      if (!substitute_reserve(error, text->length + text->length / 2 + 256)) {
+        break;
+      }
+      length = substitute_buffer.size;
+      matcher_deadline(&jit.matcher);
+      rc = pcre2_substitute(re, (PCRE2_SPTR)text->address, text->length, 0, substitute_options | PCRE2_SUBSTITUTE_OVERFLOW_LENGTH, match_data, jit.matcher.context, (PCRE2_SPTR)replace->address, replace->length, (PCRE2_UCHAR8*)substitute_buffer.address, &length);
+      if (rc == PCRE2_ERROR_NOMEMORY && length <= MSTR_LIMIT + 1 && length > substitute_buffer.size) {  // length includes the trailing zero
+        if (!substitute_reserve(error, length)) {
+          break;
+        }
+        continue;
+      }
+      if (rc == PCRE2_ERROR_NOMEMORY) {
+        error->number = E_LIMIT;
+      } else if (rc < 0) {
+        error->number = match_error(error, rc, E_SUBST);
+      } else {
+        ok = OK;
+      }
+      break;
+    }
+  }
+  match_data_put(match_data);
+  if (ok) {
+    result->address = substitute_buffer.address;
+    result->length = length;
+  }
+  return ok;
+}
+
+// Result of a replace(), the text itself or the substitute buffer
+static int replace_result(error_t *error, int argc, input_t *text, input_t *search, input_t *replace, input_t *result) {
+  result->address = text->address;
+  result->length = text->length;
+  if (argc < 2) {
+    return OK;
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return FAIL;
+  }
+  int ok = argc < 3 || pattern_substitute(error, pattern, text, replace, result);
+  pattern_release(pattern);
+  return ok;
+}
+
+EXPORT gtm_string_t *replace(int argc, input_t *text, input_t *search, input_t *replace) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  release_context(&match_context);
+  if (argc < 1) {
+    return empty_string(error);
+  }
+  input_t result;
+  if (!replace_result(error, argc, text, search, replace, &result)) {
+    return NULL;
+  }
+  return copy(error, &result);
+}
+
+// Number of matches of a test(), 0 or 1 unless global
+static int test_count(error_t *error, int argc, input_t *text, input_t *search, int *count) {
+  *count = 0;
+  if (argc < 2) {
+    return OK;
+  }
+  input_t null = { .address = "", .length = 0 };
+  if (!text->address) {
+    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return FAIL;
+  }
+  pcre2_code *re = pattern->re;
+  pcre2_match_data *match_data = match_data_get(re);
+  if (!match_data) {
+    pattern_release(pattern);
+    return ERROR_FAIL(E_MEM);
+  }
+  int rc = regex_match(pattern, text, 0, 0, match_data);
+  while (rc >= 0) {
+    (*count)++;
+    if (!pattern->opts.g) {
+      break;
+    }
+    rc = match_continue(pattern, text, match_data);
+  }
+  match_data_put(match_data);
+  pattern_release(pattern);
+  if (rc < 0 && rc != PCRE2_ERROR_NOMATCH) {
+    return ERROR_FAIL(match_error(error, rc, E_MATCH));
+  }
+  return OK;
+}
+
+EXPORT gtm_string_t *test(int argc, input_t *text, input_t *search) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  release_context(&match_context);
+  int count;
+  if (!test_count(error, argc, text, search, &count)) {
+    return NULL;
+  }
+  return int_string(error, count);
+}
+
+static void store_mem(char **begin, char *address, int length, int write) {
+  char *p = *begin;
+  if (write) {
+    memcpy(p, address, length);
+  }
+  p += length;
+  *begin = p;
+}
+
+static void store_int(char **begin, int n, int write) {
+  char str[11];  // -2,147,483,648
+  char *p = str;
+  put_int(&p, n);
+  store_mem(begin, str, p - str, write);
+}
+
+static void store_vec(char **begin, PCRE2_SIZE *ovector, int i, input_t *sep, int write) {
+  char *p = *begin;
+  store_int(&p, ovector[2*i] + 1, write);  // first M index
+  store_mem(&p, sep->address, sep->length, write);
+  store_int(&p, ovector[2*i+1], write);    // last M index
+  *begin = p;
+}
+
+static void ovector2vec(output_t *output, PCRE2_SIZE *ovector, int i, input_t *sep) {
+  int write = output->address != NULL;
+  char *p = output->address;
+  store_vec(&p, ovector, i, sep, write);
+  output->length = p - output->address;
+}
+
+static void ovector2record(output_t *output, int groups, int matches, PCRE2_SIZE *ovector, input_t *text, input_t *sep, int all, int vector) {
+  int write = output->address != NULL;
+  char *p = output->address;
+  int first = all ? 0 : 1;
+  for (int i = first; i < groups + 1; i++) {
+    if (i > first) {
+      store_mem(&p, sep->address, sep->length, write);
+    }
+    if (vector) {
+      if (i < matches && ovector[2*i] != PCRE2_UNSET) {
+        store_vec(&p, ovector, i, sep, write);
+      } else {
+        store_mem(&p, sep->address, sep->length, write);
+      }
+    } else {
+      if (i < matches) {
+        char *address = text->address + ovector[2*i];
+        int length = ovector[2*i+1] - ovector[2*i];
+        store_mem(&p, address, length, write);
+      }
+    }
+  }
+  output->length = p - output->address;
+}
+
+static output_t *match_record(error_t *error, context_t *context) {
+  int matches = (int)pcre2_get_ovector_count(context->data);
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(context->data);
+  output_t *output = gtm_malloc(sizeof(*output));
+  if (!output) {
+    return ERROR_NULL(E_MEM);
+  }
+  output->address = NULL;
+  ovector2record(output, context->groups, matches, ovector, &context->text, &context->sep, context->all, context->vector);
+  output->address = gtm_malloc(max(output->length, 1));
+  if (!output->address) {
+    return ERROR_NULL(E_MEM);
+  }
+  ovector2record(output, context->groups, matches, ovector, &context->text, &context->sep, context->all, context->vector);
+  return output;
+}
+
+// First match of the context, which is released when nothing matched or on errors
+static int context_match(error_t *error, context_t *context, input_t *text, input_t *search, input_t *sep, int *matched) {
+  if (!regex_compile(error, &context->pattern, search)) {
+    return FAIL;
+  }
+  context->re = context->pattern->re;
+  regex_opts_t *opts = &context->pattern->opts;
+  pcre2_pattern_info(context->re, PCRE2_INFO_CAPTURECOUNT, &context->groups);
+  if (context->data && pcre2_get_ovector_count(context->data) < context->groups + 1) {
+    match_data_put(context->data);
+    context->data = NULL;
+  }
+  if (!context->data) {
+    context->data = match_data_get(context->re);
+    if (!context->data) {
+      release_context(context);
+      return ERROR_FAIL(E_MEM);
+    }
+  }
+  int rc = regex_match(context->pattern, text, 0, 0, context->data);
+  if (rc < 0) {
+    release_context(context);
+    if (rc == PCRE2_ERROR_NOMATCH) {
+      *matched = 0;
+      return OK;
+    }
+    return ERROR_FAIL(match_error(error, rc, E_MATCH));
+  }
+  if (opts->a) {
+    context->all = 1;
+  }
+  if (opts->v) {
+    context->vector = 1;
+  }
+  if (opts->g) {
+    context->next = 1;
+  }
+  if (!copy_input(error, &context->text, &context->text_size, text)) {
+    release_context(context);
+    return FAIL;
+  }
+  if (sep->length && !copy_input(error, &context->sep, &context->sep_size, sep)) {
+    release_context(context);
+    return FAIL;
+  }
+  *matched = 1;
+  return OK;
+}
+
+// Next match of a global match, the context is released when there are no more matches or on errors
+static int context_step(error_t *error, context_t *context, int *matched) {
+  int rc = match_continue(context->pattern, &context->text, context->data);
+  *matched = rc >= 0;
+  if (rc >= 0) {
+    return OK;
+  }
+  release_context(context);
+  if (rc != PCRE2_ERROR_NOMATCH) {
+    return ERROR_FAIL(match_error(error, rc, E_MATCH));
+  }
+  return OK;
+}
+
+static output_t *context_next(error_t *error, context_t *context) {
+  int record = context->sep.length > 0;
+  int matched;
+  if (!context_step(error, context, &matched)) {
+    return NULL;
+  }
+  if (!record) {
+    return int_string(error, matched);
+  }
+  if (matched) {
+    return match_record(error, context);
+  }
+  return empty_string(error);
+}
+
+EXPORT gtm_string_t *match(int argc, input_t *text, input_t *search, input_t *sep) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  context_t *context = &match_context;
+  release_context(context);
+  if (argc < 1) {
+    return empty_string(error);
+  }
+  if (argc < 2) {
+    return copy(error, text);
+  }
+  input_t null = { .address = "", .length = 0 };
+  if (!text->address) {
+    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  }
+  if (argc < 3) {
+    sep = &null;
+  }
+  int matched;
+  if (!context_match(error, context, text, search, sep, &matched)) {
+    release_context(context);
+    return NULL;
+  }
+  if (!matched) {
+    release_context(context);
+    if (sep->length) {
+      return empty_string(error);
+    }
+    return int_string(error, 0);
+  }
+  if (sep->length) {
+    return match_record(error, context);
+  }
+  return int_string(error, 1);
+}
+
+EXPORT gtm_int_t end(UNUSED int argc) {
+  context_t *context = &match_context;
+  return !context->next;
+}
+
+EXPORT gtm_string_t *next(UNUSED int argc) {
+  error_t *error = &last_error;
+  context_t *context = &match_context;
+  if (!context->next) {
+    return ERROR_NULL(E_END);
+  }
+  output_t *output = context_next(error, context);
+  if (!context->re) {
+    release_context(context);
+  }
+  return output;
+}
+
+#define VECTORS_KEEP 65536
+
+// Ovectors of the matches to return, reused by matchall(), split(), lex() and replacemap() unless they grew past VECTORS_KEEP elements
+static struct {
+  PCRE2_SIZE *address;
+  long size;
+} matchall_vectors;
+
+static void vectors_trim(void) {
+  if (matchall_vectors.size > VECTORS_KEEP) {
+    free(matchall_vectors.address);
+    matchall_vectors.address = NULL;
+    matchall_vectors.size = 0;
+  }
+}
+
+// Resume offset of matchall(): M index to continue from, negated after an empty match
+static int resume_offset(PCRE2_SIZE *ovector) {
+  if (ovector[0] == ovector[1]) {
+    return -(int)ovector[1] - 1;
+  }
+  return ovector[1] + 1;
+}
+
+EXPORT gtm_string_t *matchall(int argc, input_t *text, input_t *search, input_t *fieldsep, input_t *recordsep, gtm_int_t max, gtm_int_t *resume) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return empty_string(error);
+  }
+  input_t null = { .address = "", .length = 0 };
+  if (!text->address) {
+    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  }
+  if (argc < 3) {
+    fieldsep = &null;
+  }
+  if (argc < 4) {
+    recordsep = &null;
+  }
+  if (argc < 5 || max < 0) {
+    max = 0;
+  }
+  int start = argc < 6 ? 0 : *resume;
+  if (start > text->length + 1 || (start < 0 && -(long)start - 1 > text->length)) {
+    return ERROR_NULL(E_ARG);
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return NULL;
+  }
+  pcre2_match_data *match_data = match_data_get(pattern->re);
+  if (!match_data) {
+    pattern_release(pattern);
+    return ERROR_NULL(E_MEM);
+  }
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
+  uint32_t groups;
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_CAPTURECOUNT, &groups);
+  int pairs = groups + 1;
+  int all = pattern->opts.a || !groups;  // whole match when there are no capture groups
+  int rc;
+  if (start < 0) {
+    // match_continue() skips the UTF check, nothing has validated this subject yet
+    if (pattern->utf8 && !utf_validate(error, text, match_data)) {
+      match_data_put(match_data);
+      pattern_release(pattern);
+      return NULL;
+    }
+    ovector[0] = ovector[1] = -start - 1;
+    rc = match_continue(pattern, text, match_data);
+  } else {
+    rc = regex_match(pattern, text, max(start - 1, 0), 0, match_data);
+  }
+  PCRE2_SIZE *vectors = matchall_vectors.address;
+  int count = 0;
+  int capacity = matchall_vectors.size / (2 * pairs);
+  long length = 0;
+  int next = 0;
+  while (rc >= 0) {
+    output_t record = { .address = NULL };
+    ovector2record(&record, groups, pairs, ovector, text, fieldsep, all, pattern->opts.v);
+    long total = length + record.length + (count ? recordsep->length : 0);
+    if ((max && count == max) || total > MSTR_LIMIT) {
+      if (!count) {
+        rc = PCRE2_ERROR_NOMEMORY;
+        break;
+      }
+      next = resume_offset(vectors + 2 * pairs * (count - 1));
+      break;
+    }
+    if (count == capacity) {
+      capacity = max(capacity * 2, 16);
+      PCRE2_SIZE *p = realloc(vectors, capacity * 2 * pairs * sizeof(*vectors));
+      if (!p) {
+        match_data_put(match_data);
+        pattern_release(pattern);
+        return ERROR_NULL(E_MEM);
+      }
+      vectors = p;
+      matchall_vectors.address = p;
+      matchall_vectors.size = capacity * 2 * pairs;
+    }
+    memcpy(vectors + 2 * pairs * count, ovector, 2 * pairs * sizeof(*vectors));
+    count++;
+    length = total;
+    rc = match_continue(pattern, text, match_data);
+  }
+  match_data_put(match_data);
+  if (rc < 0 && rc != PCRE2_ERROR_NOMATCH) {
+    vectors_trim();
+    pattern_release(pattern);
+    if (rc == PCRE2_ERROR_NOMEMORY) {
+      return ERROR_NULL(E_LIMIT);
+    }
+    return ERROR_NULL(match_error(error, rc, E_MATCH));
+  }
+  output_t *output = gtm_malloc(sizeof(*output));
+  if (!output || !(output->address = gtm_malloc(max(length, 1)))) {
+    vectors_trim();
+    pattern_release(pattern);
+    return ERROR_NULL(E_MEM);
+  }
+  char *p = output->address;
+  for (int i = 0; i < count; i++) {
+    if (i) {
+      store_mem(&p, recordsep->address, recordsep->length, 1);
+    }
+    output_t record = { .address = p };
+    ovector2record(&record, groups, pairs, vectors + 2 * pairs * i, text, fieldsep, all, pattern->opts.v);
+    p += record.length;
+  }
+  output->length = p - output->address;
+  vectors_trim();
+  pattern_release(pattern);
+  if (argc >= 6) {
+    *resume = next;
+  }
+  return output;
+}
+
+static int vectors_push(error_t *error, long *count, PCRE2_SIZE start, PCRE2_SIZE end) {
+  if (2 * (*count + 1) > matchall_vectors.size) {
+    long size = max(matchall_vectors.size * 2, 64);
+    PCRE2_SIZE *p = realloc(matchall_vectors.address, size * sizeof(*p));
+    if (!p) {
+      return ERROR_FAIL(E_MEM);
+    }
+    matchall_vectors.address = p;
+    matchall_vectors.size = size;
+  }
+  matchall_vectors.address[2 * *count] = start;
+  matchall_vectors.address[2 * *count + 1] = end;
+  (*count)++;
+  return OK;
+}
+
+// Text between matches joined by outsep ("," by default), like Perl's split(): limit over 0 splits into at most limit fields, 0 drops trailing empty
+// fields and below 0 keeps them. Empty matches at the start, the end or right after a match don't split the text.
+// With groups set, capture groups (empty when unset) follow the field before their match.
+EXPORT gtm_string_t *split(int argc, input_t *text, input_t *search, input_t *outsep, gtm_int_t limit, gtm_int_t groups) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return empty_string(error);
+  }
+  input_t null = { .address = "", .length = 0 };
+  input_t comma = { .address = ",", .length = 1 };
+  if (!text->address) {
+    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  }
+  if (argc < 3) {
+    outsep = &comma;
+  }
+  if (argc < 4) {
+    limit = 0;
+  }
+  if (argc < 5) {
+    groups = 0;
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return NULL;
+  }
+  pcre2_match_data *match_data = match_data_get(pattern->re);
+  if (!match_data) {
+    pattern_release(pattern);
+    return ERROR_NULL(E_MEM);
+  }
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
+  uint32_t captures = 0;
+  if (groups) {
+    pcre2_pattern_info(pattern->re, PCRE2_INFO_CAPTURECOUNT, &captures);
+  }
+  long count = 0;
+  int fields = 1;
+  PCRE2_SIZE start = 0;
+  int ok = OK;
+  int rc = limit == 1 ? PCRE2_ERROR_NOMATCH : regex_match(pattern, text, 0, 0, match_data);
+  while (rc >= 0) {
+    if (ovector[0] != ovector[1] || (ovector[0] != start && ovector[0] != (PCRE2_SIZE)text->length)) {
+      ok = vectors_push(error, &count, start, ovector[0]);
+      for (uint32_t i = 1; ok && i <= captures; i++) {
+        ok = vectors_push(error, &count, ovector[2*i], ovector[2*i+1]);
+      }
+      start = ovector[1];
+      if (!ok || ++fields == limit) {
+        break;
+      }
+    }
+    rc = match_continue(pattern, text, match_data);
+  }
+  match_data_put(match_data);
+  pattern_release(pattern);
+  if (rc < 0 && rc != PCRE2_ERROR_NOMATCH) {
+    vectors_trim();
+    return ERROR_NULL(match_error(error, rc, E_MATCH));
+  }
+  ok = ok && vectors_push(error, &count, start, text->length);
+  if (!ok) {
+    vectors_trim();
+    return NULL;
+  }
+  PCRE2_SIZE *vectors = matchall_vectors.address;
+  while (!limit && count && (vectors[2*count-2] == PCRE2_UNSET || vectors[2*count-2] == vectors[2*count-1])) {
+    count--;
+  }
+  long length = count ? (count - 1) * outsep->length : 0;
+  for (long i = 0; i < count; i++) {
+    if (vectors[2*i] != PCRE2_UNSET) {
+      length += vectors[2*i+1] - vectors[2*i];
+    }
+  }
+  if (length > MSTR_LIMIT) {
+    vectors_trim();
+    return ERROR_NULL(E_LIMIT);
+  }
+  output_t *output = gtm_malloc(sizeof(*output));
+  if (!output || !(output->address = gtm_malloc(max(length, 1)))) {
+    vectors_trim();
+    return ERROR_NULL(E_MEM);
+  }
+  char *p = output->address;
+  for (long i = 0; i < count; i++) {
+    if (i) {
+      store_mem(&p, outsep->address, outsep->length, 1);
+    }
+    if (vectors[2*i] != PCRE2_UNSET) {
+      store_mem(&p, text->address + vectors[2*i], vectors[2*i+1] - vectors[2*i], 1);
+    }
+  }
+  output->length = length;
+  vectors_trim();
+  return output;
+}
+
+static output_t *vec_string(error_t *error, PCRE2_SIZE *ovector, int i, input_t *sep) {
+  output_t *output = gtm_malloc(sizeof(*output));
+  if (!output) {
+    return ERROR_NULL(E_MEM);
+  }
+  output->address = NULL;
+  ovector2vec(output, ovector, i, sep);
+  output->address = gtm_malloc(max(output->length, 1));
+  if (!output->address) {
+    return ERROR_NULL(E_MEM);
+  }
+  ovector2vec(output, ovector, i, sep);
+  return output;
+}
+
+typedef enum {
+  GET_STRING,
+  GET_ISSET,
+  GET_ZVECTOR,
+} get_mode_t;
+
+static int group_index(error_t *error, context_t *context, int argc, input_t *name, int *i) {
+  if (!context->re) {
+    return ERROR_FAIL(E_END);
+  }
+  if (argc < 1 || !name->length) {
+    return ERROR_FAIL(E_GROUP);
+  }
+  if (!parse_int(name, i, 4)) {
+    if (!names_lookup(context->pattern, name, i)) {
+      return ERROR_FAIL(E_GROUP);
+    }
+  } else {
+    if (*i >= (int)context->groups + 1) {
+      return ERROR_FAIL(E_GROUP);
+    }
+  }
+  return OK;
+}
+
+static int group_isset(context_t *context, int i) {
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(context->data);
+  return i < (int)pcre2_get_ovector_count(context->data) && ovector[2*i] != PCRE2_UNSET;
+}
+
+static gtm_string_t *group_get(error_t *error, context_t *context, int argc, input_t *name, input_t *sep, get_mode_t mode) {
+  int i;
+  if (!group_index(error, context, argc, name, &i)) {
+    return NULL;
+  }
+  int matches = (int)pcre2_get_ovector_count(context->data);
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(context->data);
+  switch (mode) {
+    case GET_STRING:
+      {
+        if (i >= matches) {
+          return empty_string(error);
+        }
+        input_t *text = &context->text;
+        char *address = text->address + ovector[2*i];
+        int length = ovector[2*i+1] - ovector[2*i];
+        return copy_mem(error, address, length);
+      }
+    case GET_ISSET:
+      {
+        return int_string(error, group_isset(context, i));
+      }
+    case GET_ZVECTOR:
+      {
+        if (group_isset(context, i)) {
+          return vec_string(error, ovector, i, sep);
+        }
+        return empty_string(error);
+      }
+  }
+  return ERROR_NULL(E_INTERNAL);
+}
+
+EXPORT gtm_string_t *get(int argc, input_t *name) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  return group_get(error, &match_context, argc, name, NULL, GET_STRING);
+}
+
+EXPORT gtm_string_t *isset(int argc, input_t *name) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  return group_get(error, &match_context, argc, name, NULL, GET_ISSET);
+}
+
+EXPORT gtm_string_t *zvector(int argc, input_t *name, input_t *sep) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  input_t pipe = { .address = "|", .length = 1 };
+  if (argc < 2 || !sep->length) {
+    sep = &pipe;
+  }
+  return group_get(error, &match_context, argc, name, sep, GET_ZVECTOR);
+}
+
+#define HANDLE_SLOTS 65536
+#define HANDLE_GENERATIONS 32766  // generation * HANDLE_SLOTS + slot + 1 fits gtm_int_t
+
+_Static_assert((long)HANDLE_GENERATIONS * HANDLE_SLOTS + HANDLE_SLOTS <= INT_MAX, "handles overflow gtm_int_t");
+
+typedef struct stream stream_t;
+typedef struct set set_t;
+typedef struct lexer lexer_t;
+typedef struct map map_t;
+
+static void stream_free(stream_t *stream);
+static void set_free(set_t *set);
+static void lexer_free(lexer_t *lexer);
+static void map_free(map_t *map);
+
+typedef struct {
+  context_t context;
+  stream_t *stream;  // streaming matcher, the context is not used
+  set_t *set;        // pattern set, the context is not used
+  lexer_t *lexer;    // lexer rules, the context is not used
+  map_t *map;        // replacement map, the context is not used
+  int generation;
+  int open;
+  int next_free;
+} slot_t;
+
+static struct {
+  slot_t *slots;
+  int count;
+  int capacity;
+  int free;  // free list of closed slots
+} handles = { .free = -1 };
+
+static context_t *handle_open(error_t *error, int *handle) {
+  int i = handles.free;
+  if (i >= 0) {
+    handles.free = handles.slots[i].next_free;
+  } else {
+    if (handles.count == handles.capacity) {
+      if (handles.capacity == HANDLE_SLOTS) {
+        return ERROR_NULL(E_MEM);
+      }
+      int capacity = min(max(handles.capacity * 2, 16), HANDLE_SLOTS);
+      slot_t *slots = realloc(handles.slots, capacity * sizeof(*slots));
+      if (!slots) {
+        return ERROR_NULL(E_MEM);
+      }
+      handles.slots = slots;
+      handles.capacity = capacity;
+    }
+    i = handles.count++;
+    memset(&handles.slots[i], '\0', sizeof(handles.slots[i]));
+    handles.slots[i].generation = 1;
+  }
+  slot_t *slot = &handles.slots[i];
+  slot->open = 1;
+  *handle = slot->generation * HANDLE_SLOTS + i + 1;
+  return &slot->context;
+}
+
+static void handle_close(int i) {
+  slot_t *slot = &handles.slots[i];
+  release_context(&slot->context);
+  if (slot->stream) {
+    stream_free(slot->stream);
+    slot->stream = NULL;
+  }
+  if (slot->set) {
+    set_free(slot->set);
+    slot->set = NULL;
+  }
+  if (slot->lexer) {
+    lexer_free(slot->lexer);
+    slot->lexer = NULL;
+  }
+  if (slot->map) {
+    map_free(slot->map);
+    slot->map = NULL;
+  }
+  slot->open = 0;
+  slot->generation = slot->generation % HANDLE_GENERATIONS + 1;
+  slot->next_free = handles.free;
+  handles.free = i;
+}
+
+static int handle_index(int handle) {
+  if (handle <= 0) {
+    return -1;
+  }
+  int i = (handle - 1) % HANDLE_SLOTS;
+  int generation = (handle - 1) / HANDLE_SLOTS;
+  if (i >= handles.count || !handles.slots[i].open || handles.slots[i].generation != generation) {
+    return -1;
+  }
+  return i;
+}
+
+static context_t *handle_context(error_t *error, int handle) {
+  int i = handle_index(handle);
+  if (i < 0 || handles.slots[i].stream || handles.slots[i].set || handles.slots[i].lexer || handles.slots[i].map) {
+    return ERROR_NULL(E_HANDLE);
+  }
+  return &handles.slots[i].context;
+}
+
+// Handle of a new match context, 0 when nothing matched
+static int handle_match(error_t *error, int argc, input_t *text, input_t *search, input_t *sep, int *handle) {
+  *handle = 0;
+  if (argc < 2) {
+    return OK;
+  }
+  input_t null = { .address = "", .length = 0 };
+  if (!text->address) {
+    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  }
+  if (argc < 3) {
+    sep = &null;
+  }
+  int opened;
+  context_t *context = handle_open(error, &opened);
+  if (!context) {
+    return FAIL;
+  }
+  int matched;
+  if (!context_match(error, context, text, search, sep, &matched)) {
+    handle_close(handle_index(opened));
+    return FAIL;
+  }
+  if (!matched) {
+    handle_close(handle_index(opened));
+    return OK;
+  }
+  *handle = opened;
+  return OK;
+}
+
+EXPORT gtm_string_t *hmatch(int argc, input_t *text, input_t *search, input_t *sep) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  int handle;
+  if (!handle_match(error, argc, text, search, sep, &handle)) {
+    return NULL;
+  }
+  return int_string(error, handle);
+}
+
+EXPORT gtm_string_t *hrecord(int argc, gtm_int_t handle) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  context_t *context = handle_context(error, argc < 1 ? 0 : handle);
+  if (!context) {
+    return NULL;
+  }
+  return match_record(error, context);
+}
+
+EXPORT gtm_string_t *hnext(int argc, gtm_int_t handle) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  context_t *context = handle_context(error, argc < 1 ? 0 : handle);
+  if (!context) {
+    return NULL;
+  }
+  if (!context->next) {
+    return ERROR_NULL(E_END);
+  }
+  output_t *output = context_next(error, context);
+  if (!context->re) {
+    handle_close(handle_index(handle));
+  }
+  return output;
+}
+
+EXPORT gtm_int_t hend(int argc, gtm_int_t handle) {
+  int i = handle_index(argc < 1 ? 0 : handle);
+  return i < 0 || !handles.slots[i].context.next;
+}
+
+EXPORT gtm_int_t hfree(int argc, gtm_int_t handle) {
+  int i = handle_index(argc < 1 ? 0 : handle);
+  if (i < 0) {
+    return 0;
+  }
+  handle_close(i);
+  return 1;
+}
+
+EXPORT gtm_string_t *hget(int argc, gtm_int_t handle, input_t *name) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  context_t *context = handle_context(error, argc < 1 ? 0 : handle);
+  if (!context) {
+    return NULL;
+  }
+  return group_get(error, context, argc - 1, name, NULL, GET_STRING);
+}
+
+EXPORT gtm_string_t *hisset(int argc, gtm_int_t handle, input_t *name) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  context_t *context = handle_context(error, argc < 1 ? 0 : handle);
+  if (!context) {
+    return NULL;
+  }
+  return group_get(error, context, argc - 1, name, NULL, GET_ISSET);
+}
+
+EXPORT gtm_string_t *hzvector(int argc, gtm_int_t handle, input_t *name, input_t *sep) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  context_t *context = handle_context(error, argc < 1 ? 0 : handle);
+  if (!context) {
+    return NULL;
+  }
+  input_t pipe = { .address = "|", .length = 1 };
+  if (argc < 3 || !sep->length) {
+    sep = &pipe;
+  }
+  return group_get(error, context, argc - 1, name, sep, GET_ZVECTOR);
+}
+
+// Native entry points return gtm_int_t, -1 on errors, and write strings to the caller's
+// O:gtm_string_t* preallocated with MSTR_LIMIT bytes in pcre.xc, so nothing is allocated per call
+
+static int output_mem(error_t *error, output_t *output, char *address, long length) {
+  if (length > MSTR_LIMIT) {
+    return ERROR_FAIL(E_LIMIT);
+  }
+  memcpy(output->address, address, length);
+  output->length = length;
+  return OK;
+}
+
+// Written in one pass unless the record could be longer than an M string
+static int record_write(error_t *error, context_t *context, output_t *output) {
+  int matches = (int)pcre2_get_ovector_count(context->data);
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(context->data);
+  long bound = (context->groups + 1L) * (context->text.length + 2L * context->sep.length + 20);
+  if (bound > MSTR_LIMIT) {
+    output_t size = { .address = NULL };
+    ovector2record(&size, context->groups, matches, ovector, &context->text, &context->sep, context->all, context->vector);
+    if (size.length > MSTR_LIMIT) {
+      return ERROR_FAIL(E_LIMIT);
+    }
+  }
+  ovector2record(output, context->groups, matches, ovector, &context->text, &context->sep, context->all, context->vector);
+  return OK;
+}
+
+// Returns 1 when the group is set, 0 when not
+static gtm_int_t group_native(error_t *error, context_t *context, int argc, input_t *name, input_t *sep, get_mode_t mode, output_t *output) {
+  int i;
+  if (!group_index(error, context, argc, name, &i)) {
+    return -1;
+  }
+  if (!group_isset(context, i)) {
+    return 0;
+  }
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(context->data);
+  switch (mode) {
+    case GET_STRING:
+      return output_mem(error, output, context->text.address + ovector[2*i], ovector[2*i+1] - ovector[2*i]) ? 1 : -1;
+    case GET_ISSET:
+      return 1;
+    case GET_ZVECTOR:
+      if (sep->length > MSTR_LIMIT - 22) {  // two M indexes
+        return ERROR_INT(E_LIMIT);
+      }
+      ovector2vec(output, ovector, i, sep);
+      return 1;
+  }
+  return ERROR_INT(E_INTERNAL);
+}
+
+// Returns 1 and the record (with a separator) of the next match, 0 when there are no more matches
+static gtm_int_t next_native(error_t *error, context_t *context, output_t *output) {
+  if (!context->next) {
+    return ERROR_INT(E_END);
+  }
+  int matched;
+  if (!context_step(error, context, &matched)) {
+    return -1;
+  }
+  if (matched && context->sep.length && !record_write(error, context, output)) {
+    return -1;
+  }
+  return matched;
+}
+
+EXPORT gtm_int_t testn(int argc, input_t *text, input_t *search) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  release_context(&match_context);
+  int count;
+  if (!test_count(error, argc, text, search, &count)) {
+    return -1;
+  }
+  return count;
+}
+
+EXPORT gtm_int_t replacen(int argc, input_t *text, input_t *search, input_t *replace, output_t *output) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  release_context(&match_context);
+  if (argc < 4) {
+    return ERROR_INT(E_ARG);
+  }
+  output->length = 0;
+  input_t result;
+  if (!replace_result(error, argc, text, search, replace, &result) || !output_mem(error, output, result.address, result.length)) {
+    return -1;
+  }
+  return 0;
+}
+
+EXPORT gtm_int_t matchn(int argc, input_t *text, input_t *search, input_t *sep, output_t *output) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  context_t *context = &match_context;
+  release_context(context);
+  if (argc < 4) {
+    return ERROR_INT(E_ARG);
+  }
+  output->length = 0;
+  input_t null = { .address = "", .length = 0 };
+  if (!text->address) {
+    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  }
+  int matched;
+  if (!context_match(error, context, text, search, sep, &matched)) {
+    return -1;
+  }
+  if (matched && sep->length && !record_write(error, context, output)) {
+    return -1;
+  }
+  return matched;
+}
+
+EXPORT gtm_int_t nextn(int argc, output_t *output) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 1) {
+    return ERROR_INT(E_ARG);
+  }
+  output->length = 0;
+  return next_native(error, &match_context, output);
+}
+
+EXPORT gtm_int_t getn(int argc, input_t *name, output_t *output) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return ERROR_INT(E_ARG);
+  }
+  output->length = 0;
+  return group_native(error, &match_context, argc, name, NULL, GET_STRING, output);
+}
+
+EXPORT gtm_int_t issetn(int argc, input_t *name) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  return group_native(error, &match_context, argc, name, NULL, GET_ISSET, NULL);
+}
+
+EXPORT gtm_int_t zvectorn(int argc, input_t *name, input_t *sep, output_t *output) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 3) {
+    return ERROR_INT(E_ARG);
+  }
+  output->length = 0;
+  input_t pipe = { .address = "|", .length = 1 };
+  if (!sep->length) {
+    sep = &pipe;
+  }
+  return group_native(error, &match_context, argc, name, sep, GET_ZVECTOR, output);
+}
+
+EXPORT gtm_int_t hmatchn(int argc, input_t *text, input_t *search, input_t *sep) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  int handle;
+  if (!handle_match(error, argc, text, search, sep, &handle)) {
+    return -1;
+  }
+  return handle;
+}
+
+EXPORT gtm_int_t hrecordn(int argc, gtm_int_t handle, output_t *output) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return ERROR_INT(E_ARG);
+  }
+  output->length = 0;
+  context_t *context = handle_context(error, handle);
+  if (!context || !record_write(error, context, output)) {
+    return -1;
+  }
+  return 1;
+}
+
+EXPORT gtm_int_t hnextn(int argc, gtm_int_t handle, output_t *output) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return ERROR_INT(E_ARG);
+  }
+  output->length = 0;
+  context_t *context = handle_context(error, handle);
+  if (!context) {
+    return -1;
+  }
+  gtm_int_t matched = next_native(error, context, output);
+  if (!context->re) {
+    handle_close(handle_index(handle));
+  }
+  return matched;
+}
+
+EXPORT gtm_int_t hgetn(int argc, gtm_int_t handle, input_t *name, output_t *output) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 3) {
+    return ERROR_INT(E_ARG);
+  }
+  output->length = 0;
+  context_t *context = handle_context(error, handle);
+  if (!context) {
+    return -1;
+  }
+  return group_native(error, context, argc - 1, name, NULL, GET_STRING, output);
+}
+
+EXPORT gtm_int_t hissetn(int argc, gtm_int_t handle, input_t *name) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  context_t *context = handle_context(error, argc < 1 ? 0 : handle);
+  if (!context) {
+    return -1;
+  }
+  return group_native(error, context, argc - 1, name, NULL, GET_ISSET, NULL);
+}
+
+EXPORT gtm_int_t hzvectorn(int argc, gtm_int_t handle, input_t *name, input_t *sep, output_t *output) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 4) {
+    return ERROR_INT(E_ARG);
+  }
+  output->length = 0;
+  context_t *context = handle_context(error, handle);
+  if (!context) {
+    return -1;
+  }
+  input_t pipe = { .address = "|", .length = 1 };
+  if (!sep->length) {
+    sep = &pipe;
+  }
+  return group_native(error, context, argc - 1, name, sep, GET_ZVECTOR, output);
+}
+
+typedef struct {
+  char *address;
+  int length;
+  int size;
+} buffer_t;
+
+static int buffer_reserve(error_t *error, buffer_t *buffer, int length) {
+  if (buffer->length + length <= buffer->size) {
+    return OK;
+  }
+  int size = max(buffer->size * 2, 256);
+  while (size < buffer->length + length) {
+    size *= 2;
+  }
+  char *address = realloc(buffer->address, size);
+  if (!address) {
+    return ERROR_FAIL(E_MEM);
+  }
+  buffer->address = address;
+  buffer->size = size;
+  return OK;
+}
+
+static int buffer_append(error_t *error, buffer_t *buffer, char *address, int length) {
+  if (!length) {
+    return OK;
+  }
+  if (!buffer_reserve(error, buffer, length)) {
+    return FAIL;
+  }
+  memcpy(buffer->address + buffer->length, address, length);
+  buffer->length += length;
+  return OK;
+}
+
+static int buffer_append_int(error_t *error, buffer_t *buffer, int n) {
+  char s[11];  // -2,147,483,648
+  char *p = s;
+  put_int(&p, n);
+  return buffer_append(error, buffer, s, p - s);
+}
+
+#define SUBSCRIPT_SIZE 64
+
+// Local or global variable name with its subscripts, e.g. ^DATA("ACCT",2024)
+typedef struct {
+  ydb_buffer_t name;
+  char text[32];
+  int count;
+  ydb_buffer_t subs[YDB_MAX_SUBS];
+} variable_t;
+
+static void variable_free(variable_t *variable) {
+  for (int i = 0; i < YDB_MAX_SUBS; i++) {
+    free(variable->subs[i].buf_addr);
+  }
+  memset(variable, '\0', sizeof(*variable));
+}
+
+static int subscript_reserve(error_t *error, ydb_buffer_t *sub, int length) {
+  if (sub->buf_addr && (int)sub->len_alloc >= length) {
+    return OK;
+  }
+  char *p = realloc(sub->buf_addr, max(length, SUBSCRIPT_SIZE));
+  if (!p) {
+    return ERROR_FAIL(E_MEM);
+  }
+  sub->buf_addr = p;
+  sub->len_alloc = max(length, SUBSCRIPT_SIZE);
+  return OK;
+}
+
+static int subscript_set(error_t *error, ydb_buffer_t *sub, char *address, int length) {
+  if (!subscript_reserve(error, sub, length)) {
+    return FAIL;
+  }
+  memcpy(sub->buf_addr, address, length);
+  sub->len_used = length;
+  return OK;
+}
+
+// Subscripts are string literals ("" for a quote) or numbers
+static int parse_variable(error_t *error, variable_t *variable, input_t *input) {
+  memset(variable, '\0', sizeof(*variable));
+  char *p = input->address;
+  char *end = p + input->length;
+  char *q = variable->text;
+  if (p < end && *p == '^') {
+    *q++ = *p++;
+  }
+  if (p == end || !(isalpha(*p) || *p == '%')) {
+    return ERROR_FAIL(E_NAME);
+  }
+  *q++ = *p++;
+  while (p < end && (isalpha(*p) || isdigit(*p))) {
+    if (q - variable->text == 31) {
+      return ERROR_FAIL(E_NAME);
+    }
+    *q++ = *p++;
+  }
+  variable->name.buf_addr = variable->text;
+  variable->name.len_used = variable->name.len_alloc = q - variable->text;
+  if (p == end) {
+    return OK;
+  }
+  if (*p++ != '(') {
+    return ERROR_FAIL(E_NAME);
+  }
+  char sub[YDB_MAX_KEYSZ];
+  for (;;) {
+    if (variable->count == YDB_MAX_SUBS || p == end) {
+      variable_free(variable);
+      return ERROR_FAIL(E_NAME);
+    }
+    int length = 0;
+    if (*p == '"') {
+      for (p++;; p++) {
+        if (p == end || length == sizeof(sub)) {
+          variable_free(variable);
+          return ERROR_FAIL(E_NAME);
+        }
+        if (*p == '"') {
+          if (p + 1 == end || p[1] != '"') {
+            break;
+          }
+          p++;
+        }
+        sub[length++] = *p;
+      }
+      p++;
+    } else {
+      while (p < end && length < (int)sizeof(sub) && (isdigit(*p) || *p == '.' || *p == '-')) {
+        sub[length++] = *p++;
+      }
+      if (!length) {
+        variable_free(variable);
+        return ERROR_FAIL(E_NAME);
+      }
+    }
+    if (!subscript_set(error, &variable->subs[variable->count++], sub, length)) {
+      variable_free(variable);
+      return FAIL;
+    }
+    if (p < end && *p == ',') {
+      p++;
+      continue;
+    }
+    if (p + 1 == end && *p == ')') {
+      return OK;
+    }
+    variable_free(variable);
+    return ERROR_FAIL(E_NAME);
+  }
+}
+
+// Canonical M number: no leading or trailing zeros, no "+", no trailing "."
+static int canonical_number(char *address, int length) {
+  char *p = address;
+  char *end = p + length;
+  if (p < end && *p == '-') {
+    p++;
+  }
+  char *digits = p;
+  while (p < end && isdigit(*p)) {
+    p++;
+  }
+  int integer = p - digits;
+  if (integer > 1 && *digits == '0') {
+    return 0;
+  }
+  if (integer == 1 && *digits == '0' && (digits > address || p < end)) {
+    return 0;
+  }
+  if (p < end) {
+    if (*p++ != '.' || p == end) {
+      return 0;
+    }
+    while (p < end && isdigit(*p)) {
+      p++;
+    }
+    if (p < end || end[-1] == '0') {
+      return 0;
+    }
+  }
+  return integer || length > 1;
+}
+
+// Some canonical number may start with the text, so subscripts starting with it are not contiguous
+static int number_prefix(char *address, int length) {
+  char *p = address;
+  char *end = p + length;
+  if (p < end && *p == '-') {
+    p++;
+  }
+  while (p < end && isdigit(*p)) {
+    p++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+  }
+  while (p < end && isdigit(*p)) {
+    p++;
+  }
+  return p == end;
+}
+
+// Variable reference as $NAME() would show it
+static int store_reference(error_t *error, buffer_t *buffer, ydb_buffer_t *name, int count, ydb_buffer_t *subs) {
+  if (!buffer_append(error, buffer, name->buf_addr, name->len_used)) {
+    return FAIL;
+  }
+  for (int i = 0; i < count; i++) {
+    if (!buffer_append(error, buffer, i ? "," : "(", 1)) {
+      return FAIL;
+    }
+    unsigned char *p = (unsigned char *)subs[i].buf_addr;
+    unsigned char *end = p + subs[i].len_used;
+    if (canonical_number((char *)p, end - p)) {
+      if (!buffer_append(error, buffer, (char *)p, end - p)) {
+        return FAIL;
+      }
+      continue;
+    }
+    int quoted = 0;
+    int first = 1;
+    while (first || p < end) {
+      if (p < end && (*p < 32 || *p == 127)) {
+        if (quoted && !buffer_append(error, buffer, "\"", 1)) {
+          return FAIL;
+        }
+        if (!buffer_append(error, buffer, first ? "$C(" : "_$C(", first ? 3 : 4)) {
+          return FAIL;
+        }
+        for (int j = 0; p < end && (*p < 32 || *p == 127); j++, p++) {
+          if ((j && !buffer_append(error, buffer, ",", 1)) || !buffer_append_int(error, buffer, *p)) {
+            return FAIL;
+          }
+        }
+        if (!buffer_append(error, buffer, ")", 1)) {
+          return FAIL;
+        }
+        quoted = 0;
+      } else {
+        if (!quoted && !buffer_append(error, buffer, first ? "\"" : "_\"", first ? 1 : 2)) {
+          return FAIL;
+        }
+        quoted = 1;
+        while (p < end && *p >= 32 && *p != 127) {
+          if ((*p == '"' && !buffer_append(error, buffer, "\"", 1)) || !buffer_append(error, buffer, (char *)p, 1)) {
+            return FAIL;
+          }
+          p++;
+        }
+      }
+      first = 0;
+    }
+    if (quoted && !buffer_append(error, buffer, "\"", 1)) {
+      return FAIL;
+    }
+  }
+  if (count && !buffer_append(error, buffer, ")", 1)) {
+    return FAIL;
+  }
+  return OK;
+}
+
+// Depth-first walk over the nodes with a value in a subtree (including its root)
+typedef struct {
+  variable_t root;
+  int started;
+  int count;                // subscripts of the current node
+  ydb_buffer_t *subs;       // current node
+  ydb_buffer_t *next;       // ydb_node_next_s() result
+  ydb_buffer_t buffers[2][YDB_MAX_SUBS];
+  ydb_buffer_t value;
+} walk_t;
+
+static void walk_close(walk_t *walk) {
+  variable_free(&walk->root);
+  for (int i = 0; i < YDB_MAX_SUBS; i++) {
+    free(walk->buffers[0][i].buf_addr);
+    free(walk->buffers[1][i].buf_addr);
+  }
+  free(walk->value.buf_addr);
+  memset(walk, '\0', sizeof(*walk));
+}
+
+static int walk_open(error_t *error, walk_t *walk, input_t *gvn) {
+  memset(walk, '\0', sizeof(*walk));
+  if (!parse_variable(error, &walk->root, gvn)) {
+    return FAIL;
+  }
+  walk->subs = walk->buffers[0];
+  walk->next = walk->buffers[1];
+  walk->count = walk->root.count;
+  for (int i = 0; i < walk->count; i++) {
+    if (!subscript_set(error, &walk->subs[i], walk->root.subs[i].buf_addr, walk->root.subs[i].len_used)) {
+      walk_close(walk);
+      return FAIL;
+    }
+  }
+  for (int i = 0; i < YDB_MAX_SUBS; i++) {
+    if (!subscript_reserve(error, &walk->subs[i], 0) || !subscript_reserve(error, &walk->next[i], 0)) {
+      walk_close(walk);
+      return FAIL;
+    }
+  }
+  return OK;
+}
+
+static int walk_next(error_t *error, walk_t *walk, int *found) {
+  variable_t *root = &walk->root;
+  if (!walk->started) {
+    walk->started = 1;
+    unsigned int data;
+    int status = ydb_data_s(&root->name, root->count, root->subs, &data);
+    if (status != YDB_OK) {
+      return ydb_error(error, status);
+    }
+    if (data % 10) {
+      *found = 1;
+      return OK;
+    }
+  }
+  for (;;) {
+    int count = YDB_MAX_SUBS;
+    int status = ydb_node_next_s(&root->name, walk->count, walk->subs, &count, walk->next);
+    if (status == YDB_ERR_NODEEND) {
+      *found = 0;
+      return OK;
+    }
+    if (status == YDB_ERR_INVSTRLEN) {  // count is the index of the short buffer
+      if (!subscript_reserve(error, &walk->next[count], walk->next[count].len_used)) {
+        return FAIL;
+      }
+      continue;
+    }
+    if (status != YDB_OK) {
+      return ydb_error(error, status);
+    }
+    ydb_buffer_t *subs = walk->subs;
+    walk->subs = walk->next;
+    walk->next = subs;
+    walk->count = count;
+    *found = count >= root->count;
+    for (int i = 0; *found && i < root->count; i++) {
+      *found = !mem_eq(walk->subs[i].buf_addr, walk->subs[i].len_used, root->subs[i].buf_addr, root->subs[i].len_used);
+    }
+    return OK;
+  }
+}
+
+static int walk_value(error_t *error, walk_t *walk, input_t *value) {
+  for (;;) {
+    int status = ydb_get_s(&walk->root.name, walk->count, walk->subs, &walk->value);
+    if (status == YDB_ERR_INVSTRLEN) {
+      int size = walk->value.len_used;
+      char *address = realloc(walk->value.buf_addr, size);
+      if (!address) {
+        return ERROR_FAIL(E_MEM);
+      }
+      walk->value.buf_addr = address;
+      walk->value.len_alloc = size;
+      continue;
+    }
+    if (status != YDB_OK) {
+      return ydb_error(error, status);
+    }
+    value->address = walk->value.buf_addr;
+    value->length = walk->value.len_used;
+    if (!value->address) {
+      value->address = "";  // pcre2_match() doesn't accept .address=NULL
+    }
+    return OK;
+  }
+}
+
+// Appends one result to lvn(n) or to the returned record
+typedef struct {
+  buffer_t record;
+  variable_t lvn;
+  int count;
+} results_t;
+
+static int results_open(error_t *error, results_t *results, int argc, input_t *lvn) {
+  memset(results, '\0', sizeof(*results));
+  if (argc < 1 || !lvn->length) {
+    return OK;
+  }
+  if (!parse_variable(error, &results->lvn, lvn) || results->lvn.name.buf_addr[0] == '^' || results->lvn.count == YDB_MAX_SUBS) {
+    variable_free(&results->lvn);
+    return ERROR_FAIL(E_NAME);
+  }
+  return OK;
+}
+
+static int results_add(error_t *error, results_t *results, buffer_t *result) {
+  results->count++;
+  variable_t *lvn = &results->lvn;
+  if (!lvn->name.len_used) {
+    if (results->count > 1 && !buffer_append(error, &results->record, "\n", 1)) {
+      return FAIL;
+    }
+    if (!buffer_append(error, &results->record, result->address, result->length)) {
+      return FAIL;
+    }
+    if (results->record.length > MSTR_LIMIT) {
+      return ERROR_FAIL(E_LIMIT);
+    }
+    return OK;
+  }
+  char s[11];
+  char *p = s;
+  put_int(&p, results->count);
+  if (!subscript_set(error, &lvn->subs[lvn->count], s, p - s)) {
+    return FAIL;
+  }
+  ydb_buffer_t value = { .buf_addr = result->address, .len_used = result->length, .len_alloc = result->length };
+  int status = ydb_set_s(&lvn->name, lvn->count + 1, lvn->subs, &value);
+  if (status != YDB_OK) {
+    return ydb_error(error, status);
+  }
+  return OK;
+}
+
+static output_t *results_close(error_t *error, results_t *results, int ok) {
+  output_t *output = NULL;
+  if (ok) {
+    if (results->lvn.name.len_used) {
+      output = int_string(error, results->count);
+    } else {
+      output = results->record.length ? copy_mem(error, results->record.address, results->record.length) : empty_string(error);
+    }
+  }
+  free(results->record.address);
+  variable_free(&results->lvn);
+  return output;
+}
+
+// Sets name(group) for every set capture group, by number and by name, with a separator
+// also name(group,"z") to firstIndex_separator_lastIndex, the variable is killed first
+static int context_export(error_t *error, context_t *context, int argc, input_t *lvn, input_t *sep, int *count) {
+  *count = 0;
+  if (!context->re) {
+    return ERROR_FAIL(E_END);
+  }
+  variable_t variable;
+  if (argc < 1) {
+    return ERROR_FAIL(E_NAME);
+  }
+  if (!parse_variable(error, &variable, lvn)) {
+    return FAIL;
+  }
+  if (variable.name.buf_addr[0] == '^' || variable.count > YDB_MAX_SUBS - 2) {
+    variable_free(&variable);
+    return ERROR_FAIL(E_NAME);
+  }
+  int n = variable.count;
+  int zvector = argc >= 2 && sep->length;
+  int status = ydb_delete_s(&variable.name, n, variable.subs, YDB_DEL_TREE);
+  int ok = status == YDB_OK ? OK : ydb_error(error, status);
+  ok = ok && (!zvector || subscript_set(error, &variable.subs[n + 1], "z", 1));
+  buffer_t vector = { .address = NULL };
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(context->data);
+  names_t *names = &context->pattern->names;
+  if (!names->built) {
+    names_build(context->pattern);
+  }
+  // numbered groups first, then the name table
+  for (int k = 0; ok && k < (int)(context->groups + 1 + names->count); k++) {
+    int i = k;
+    if (k <= (int)context->groups) {
+      char number[11];
+      char *p = number;
+      put_int(&p, i);
+      ok = subscript_set(error, &variable.subs[n], number, p - number);
+    } else {
+      char *name = names_entry(names, k - context->groups - 1, &i);
+      ok = subscript_set(error, &variable.subs[n], name, strlen(name));
+    }
+    if (!ok || !group_isset(context, i)) {
+      continue;
+    }
+    if (k <= (int)context->groups) {
+      (*count)++;
+    }
+    ydb_buffer_t value = { .buf_addr = context->text.address + ovector[2*i], .len_used = ovector[2*i+1] - ovector[2*i] };
+    value.len_alloc = value.len_used;
+    status = ydb_set_s(&variable.name, n + 1, variable.subs, &value);
+    if (status == YDB_OK && zvector) {
+      vector.length = 0;
+      ok = buffer_reserve(error, &vector, 22 + sep->length);  // two M indexes
+      if (ok) {
+        output_t output = { .address = vector.address };
+        ovector2vec(&output, ovector, i, sep);
+        ydb_buffer_t offsets = { .buf_addr = output.address, .len_used = output.length, .len_alloc = output.length };
+        status = ydb_set_s(&variable.name, n + 2, variable.subs, &offsets);
+      }
+    }
+    if (status != YDB_OK) {
+      ok = ydb_error(error, status);
+    }
+  }
+  free(vector.address);
+  variable_free(&variable);
+  return ok;
+}
+
+EXPORT gtm_string_t *export_groups(int argc, input_t *lvn, input_t *sep) {
+  error_t *error = &last_error;
+  clear_error(error, "export");
+  int count;
+  if (!context_export(error, &match_context, argc, lvn, sep, &count)) {
+    return NULL;
+  }
+  return int_string(error, count);
+}
+
+EXPORT gtm_string_t *hexport(int argc, gtm_int_t handle, input_t *lvn, input_t *sep) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  context_t *context = handle_context(error, argc < 1 ? 0 : handle);
+  if (!context) {
+    return NULL;
+  }
+  int count;
+  if (!context_export(error, context, argc - 1, lvn, sep, &count)) {
+    return NULL;
+  }
+  return int_string(error, count);
+}
+
+#define SCAN_THREADS 1
+#define SCAN_THREADS_MAX 64
+#define SCAN_BATCH_NODES 1024
+#define SCAN_BATCH_BYTES 4194304
+
+// Nodes read by the calling thread, matched by the workers
+typedef struct {
+  int value;  // offsets into data
+  int length;
+  int subs;
+  int count;
+  int matched;
+  int replaced;  // offset of the new value in data, for greplace()
+  int replaced_length;
+} node_t;
+
+typedef struct {
+  node_t *nodes;
+  int count;
+  int size;
+  buffer_t data;
+} batch_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  int round;   // incremented for every batch handed out
+  int busy;    // workers still matching the batch
+  int next;    // next node to match
+  int stop;
+  int rc;      // first pcre2 error
+  batch_t *batch;
+  pattern_t *pattern;
+} pool_t;
+
+typedef struct {
+  pool_t *pool;
+  pthread_t thread;
+  pcre2_match_data *data;
+  matcher_t matcher;
+} worker_t;
+
+static void batch_free(batch_t *batch) {
+  free(batch->nodes);
+  free(batch->data.address);
+}
+
+static int batch_add(error_t *error, batch_t *batch, walk_t *walk, input_t *value) {
+  if (batch->count == batch->size) {
+    int size = max(batch->size * 2, 64);
+    node_t *nodes = realloc(batch->nodes, size * sizeof(node_t));
+    if (!nodes) {
+      return ERROR_FAIL(E_MEM);
+    }
+    batch->nodes = nodes;
+    batch->size = size;
+  }
+  node_t *node = &batch->nodes[batch->count];
+  node->value = batch->data.length;
+  node->length = value->length;
+  if (!buffer_append(error, &batch->data, value->address, value->length)) {
+    return FAIL;
+  }
+  node->subs = batch->data.length;
+  node->count = walk->count;
+  for (int i = 0; i < walk->count; i++) {
+    int length = walk->subs[i].len_used;
+    if (!buffer_append(error, &batch->data, (char*)&length, sizeof(length)) || !buffer_append(error, &batch->data, walk->subs[i].buf_addr, length)) {
+      return FAIL;
+    }
+  }
+  node->matched = 0;
+  batch->count++;
+  return OK;
+}
+
+static void batch_subs(batch_t *batch, node_t *node, ydb_buffer_t *subs) {
+  char *p = batch->data.address + node->subs;
+  for (int i = 0; i < node->count; i++) {
+    int length;
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    subs[i] = (ydb_buffer_t){ .buf_addr = p, .len_used = length, .len_alloc = length };
+    p += length;
+  }
+}
+
+static void *worker_run(void *arg) {
+  worker_t *worker = arg;
+  pool_t *pool = worker->pool;
+  int round = 0;
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    while (pool->round == round && !pool->stop) {
+      pthread_cond_wait(&pool->start, &pool->mutex);
+    }
+    if (pool->stop) {
+      break;
+    }
+    round = pool->round;
+    batch_t *batch = pool->batch;
+    pthread_mutex_unlock(&pool->mutex);
+    int error = 0;
+    for (;;) {
+      int i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+      if (i >= batch->count) {
+        break;
+      }
+      node_t *node = &batch->nodes[i];
+      input_t value = { .address = batch->data.address + node->value, .length = node->length };
+      int rc = matcher_match(&worker->matcher, pool->pattern, &value, 0, 0, worker->data);
+      node->matched = rc >= 0;
+      if (rc < 0 && rc != PCRE2_ERROR_NOMATCH && !error) {
+        error = rc;
+      }
+    }
+    pthread_mutex_lock(&pool->mutex);
+    if (error && !pool->rc) {
+      pool->rc = error;
+    }
+    if (!--pool->busy) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+static void pool_dispatch(pool_t *pool, batch_t *batch, int threads) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->batch = batch;
+  pool->next = 0;
+  pool->busy = threads;
+  pool->round++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+static int pool_wait(pool_t *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->busy) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  int rc = pool->rc;
+  pthread_mutex_unlock(&pool->mutex);
+  return rc;
+}
+
+static void pool_stop(pool_t *pool, worker_t *workers, int threads) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    match_data_put(workers[i].data);
+    matcher_free(&workers[i].matcher);
+  }
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->mutex);
+}
+
+// Fills the batch from the walk, *found is cleared at the end of the subtree
+static int scan_read(error_t *error, walk_t *walk, batch_t *batch, int *found) {
+  batch->count = 0;
+  batch->data.length = 0;
+  while (*found && batch->count < SCAN_BATCH_NODES && batch->data.length < SCAN_BATCH_BYTES) {
+    input_t value;
+    if (!walk_next(error, walk, found)) {
+      return FAIL;
+    }
+    if (*found && (!walk_value(error, walk, &value) || !batch_add(error, batch, walk, &value))) {
+      return FAIL;
+    }
+  }
+  return OK;
+}
+
+// Database access stays on the calling thread, the workers only run pcre2 on values
+// already read, so the batch being matched overlaps with reading the next one.
+// Workers start with all signals blocked, YottaDB timer and interrupt signals (SIGALRM,
+// SIGUSR1 for $ZTIMEOUT or MUPIP INTRPT) must go to the process thread, not to them.
+static int scan_parallel(error_t *error, walk_t *walk, pattern_t *pattern, int threads, int max, results_t *results) {
+  if (jit.available && !pattern->jit) {
+    pattern_jit(pattern);
+  }
+  pool_t pool = { .round = 0 };
+  worker_t workers[SCAN_THREADS_MAX];
+  pthread_mutex_init(&pool.mutex, NULL);
+  pthread_cond_init(&pool.start, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  pool.pattern = pattern;
+  int started = 0;
+  int ok = OK;
+  sigset_t all, caller;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &caller);  // inherited by the workers
+  for (; started < threads; started++) {
+    worker_t *worker = &workers[started];
+    worker->pool = &pool;
+    if (!matcher_init(&worker->matcher)) {
+      ok = ERROR_FAIL(E_MEM);
+      break;
+    }
+    worker->data = match_data_get(pattern->re);
+    if (!worker->data || pthread_create(&worker->thread, NULL, worker_run, worker)) {
+      if (worker->data) {
+        match_data_put(worker->data);
+      }
+      matcher_free(&worker->matcher);
+      ok = ERROR_FAIL(E_MEM);
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &caller, NULL);
+  batch_t batches[2] = { { .count = 0 }, { .count = 0 } };
+  buffer_t reference = { .address = NULL };
+  ydb_buffer_t subs[YDB_MAX_SUBS];
+  int found = 1;
+  int current = 0;
+  ok = ok && scan_read(error, walk, &batches[current], &found);
+  while (ok && batches[current].count) {
+    batch_t *batch = &batches[current];
+    pool_dispatch(&pool, batch, threads);
+    batch_t *next = &batches[!current];
+    next->count = 0;
+    if (found && (!max || results->count < max)) {
+      ok = scan_read(error, walk, next, &found);
+    }
+    int rc = pool_wait(&pool);
+    if (rc) {
+      ok = ERROR_FAIL(match_error(error, rc, E_MATCH));
+    }
+    for (int i = 0; ok && i < batch->count && (!max || results->count < max); i++) {
+      node_t *node = &batch->nodes[i];
+      if (!node->matched) {
+        continue;
+      }
+      batch_subs(batch, node, subs);
+      reference.length = 0;
+      ok = store_reference(error, &reference, &walk->root.name, node->count, subs) && results_add(error, results, &reference);
+    }
+    if (max && results->count >= max) {
+      break;
+    }
+    current = !current;
+  }
+  pool_stop(&pool, workers, started);
+  batch_free(&batches[0]);
+  batch_free(&batches[1]);
+  free(reference.address);
+  return ok;
+}
+
+EXPORT gtm_string_t *gscan(int argc, input_t *gvn, input_t *search, gtm_int_t max, input_t *lvn, gtm_int_t threads) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return ERROR_NULL(E_ARG);
+  }
+  if (argc < 3 || max < 0) {
+    max = 0;
+  }
+  if (argc < 5 || threads < 1) {
+    threads = env_long("pcre_scan_threads", SCAN_THREADS, SCAN_THREADS_MAX);
+  }
+  threads = max(1, min(threads, SCAN_THREADS_MAX));
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return NULL;
+  }
+  pcre2_match_data *match_data = match_data_get(pattern->re);
+  results_t results;
+  walk_t walk;
+  buffer_t reference = { .address = NULL };
+  int ok = match_data && results_open(error, &results, argc - 3, lvn);
+  if (!ok) {
+    if (match_data) {
+      match_data_put(match_data);
+    }
+    pattern_release(pattern);
+    return match_data ? NULL : ERROR_NULL(E_MEM);
+  }
+  ok = walk_open(error, &walk, gvn);
+  if (ok && threads > 1) {
+    ok = scan_parallel(error, &walk, pattern, threads, max, &results);
+  }
+  int found = ok && threads == 1;
+  while (ok && found && (!max || results.count < max)) {
+    ok = walk_next(error, &walk, &found);
+    if (!ok || !found) {
+      break;
+    }
+    input_t value;
+    ok = walk_value(error, &walk, &value);
+    if (!ok) {
+      break;
+    }
+    int rc = regex_match(pattern, &value, 0, 0, match_data);
+    if (rc == PCRE2_ERROR_NOMATCH) {
+      continue;
+    }
+    if (rc < 0) {
+      ok = ERROR_FAIL(match_error(error, rc, E_MATCH));
+      break;
+    }
+    reference.length = 0;
+    ok = store_reference(error, &reference, &walk.root.name, walk.count, walk.subs) && results_add(error, &results, &reference);
+  }
+  walk_close(&walk);
+  free(reference.address);
+  match_data_put(match_data);
+  pattern_release(pattern);
+  return results_close(error, &results, ok);
+}
+
+// Alternatives at the top level, or constructs that would hide them from this scan
+static int regex_alternatives(char *p, char *end) {
+  int depth = 0;
+  while (p < end) {
+    if (*p == '\\') {
+      if (p + 1 < end && p[1] == 'Q') {
+        return 1;
+      }
+      p += 2;
+      continue;
+    }
+    if (*p == '[') {
+      p++;
+      if (p < end && *p == '^') {
+        p++;
+      }
+      if (p < end && *p == ']') {
+        p++;
+      }
+      while (p < end && *p != ']') {
+        if (*p == '\\') {
+          p++;
+        } else if (*p == '[' && p + 1 < end && p[1] == ':') {
+          char *posix = memmem(p, end - p, ":]", 2);
+          if (posix) {
+            p = posix + 1;
+          }
+        }
+        p++;
+      }
+      p++;
+      continue;
+    }
+    if (*p == '(') {
+      if (end - p >= 3 && !memcmp(p, "(?#", 3)) {
+        return 1;
+      }
+      depth++;
+    } else if (*p == ')') {
+      depth--;
+    } else if (*p == '|' && !depth) {
+      return 1;
+    }
+    p++;
+  }
+  return 0;
+}
+
+// Literal text every match starts with, for patterns anchored by a leading ^ or \A. Left empty when there is
+// none or when the regex is too involved to tell (alternatives, caseless or extended parts, multiline mode).
+static int anchored_prefix(error_t *error, pattern_t *pattern, buffer_t *prefix) {
+  prefix->length = 0;
+  uint32_t options;
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_ALLOPTIONS, &options);
+  char *p = pattern->key + 1;
+  char *end = memrchr(p, '/', pattern->length - 1);
+  if (!(options & PCRE2_ANCHORED) || pattern->opts.m || pattern->opts.x || regex_caseless(pattern, p, end - p) || regex_inline_option(p, end - p, 'x') || regex_alternatives(p, end)) {
+    return OK;
+  }
+  if (p < end && *p == '^') {
+    p++;
+  } else if (end - p >= 2 && !memcmp(p, "\\A", 2)) {
+    p += 2;
+  } else {
+    return OK;
+  }
+  while (p < end) {
+    char *c = p;
+    if (*c == '\\') {
+      if (++c == end || isalpha(*c) || isdigit(*c)) {
+        break;
+      }
+    } else if (strchr("^$.|?*+()[]{}", *c)) {
+      break;
+    }
+    char *next = c + 1;
+    while (pattern->utf8 && next < end && (*next & 0xC0) == 0x80) {  // whole character before a quantifier
+      next++;
+    }
+    if (next < end && strchr("?*{", *next)) {  // optional (or a quantifier that may be)
+      break;
+    }
+    if (!buffer_append(error, prefix, c, next - c)) {
+      return FAIL;
+    }
+    p = next;
+    if (p < end && *p == '+') {
+      break;
+    }
+  }
+  return OK;
+}
+
+// Subscripts sorting after the prefix don't start with it once past the numbers (standard collation),
+// so a search with a literal prefix visits only the range of subscripts starting with it
+EXPORT gtm_string_t *gkeys(int argc, input_t *gvn, input_t *search, gtm_int_t max, input_t *lvn) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return ERROR_NULL(E_ARG);
+  }
+  if (argc < 3 || max < 0) {
+    max = 0;
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return NULL;
+  }
+  pcre2_match_data *match_data = match_data_get(pattern->re);
+  results_t results;
+  int ok = match_data && results_open(error, &results, argc - 3, lvn);
+  if (!ok) {
+    if (match_data) {
+      match_data_put(match_data);
+    }
+    pattern_release(pattern);
+    return match_data ? NULL : ERROR_NULL(E_MEM);
+  }
+  variable_t variable;
+  ydb_buffer_t next = { .buf_addr = NULL };
+  buffer_t prefix = { .address = NULL };
+  buffer_t reference = { .address = NULL };
+  ok = parse_variable(error, &variable, gvn);
+  if (ok && variable.count == YDB_MAX_SUBS) {
+    ok = ERROR_FAIL(E_NAME);
+  }
+  int count = variable.count + 1;
+  ydb_buffer_t *sub = &variable.subs[variable.count];
+  ok = ok && subscript_reserve(error, sub, 0) && subscript_reserve(error, &next, 0) && anchored_prefix(error, pattern, &prefix);
+  sub->len_used = 0;
+  int seek = ok && prefix.length && !number_prefix(prefix.address, prefix.length);
+  int found = 0;
+  if (seek) {
+    unsigned int data;
+    ok = subscript_set(error, sub, prefix.address, prefix.length);
+    int status = ok ? ydb_data_s(&variable.name, count, variable.subs, &data) : YDB_OK;
+    if (status != YDB_OK) {
+      ok = ydb_error(error, status);
+    }
+    found = ok && data;
+  }
+  while (ok && (!max || results.count < max)) {
+    if (!found) {
+      int status = ydb_subscript_next_s(&variable.name, count, variable.subs, &next);
+      if (status == YDB_ERR_NODEEND) {
+        break;
+      }
+      if (status == YDB_ERR_INVSTRLEN) {
+        ok = subscript_reserve(error, &next, next.len_used);
+        continue;
+      }
+      if (status != YDB_OK) {
+        ok = ydb_error(error, status);
+        break;
+      }
+      ydb_buffer_t swap = *sub;
+      *sub = next;
+      next = swap;
+    }
+    found = 0;
+    input_t value = { .address = sub->buf_addr, .length = sub->len_used };
+    if (seek && (value.length < prefix.length || mem_eq(value.address, prefix.length, prefix.address, prefix.length))) {
+      break;
+    }
+    int rc = regex_match(pattern, &value, 0, 0, match_data);
+    if (rc == PCRE2_ERROR_NOMATCH) {
+      continue;
+    }
+    if (rc < 0) {
+      ok = ERROR_FAIL(match_error(error, rc, E_MATCH));
+      break;
+    }
+    reference.length = 0;
+    ok = store_reference(error, &reference, &variable.name, count, variable.subs) && results_add(error, &results, &reference);
+  }
+  variable_free(&variable);
+  free(next.buf_addr);
+  free(prefix.address);
+  free(reference.address);
+  match_data_put(match_data);
+  pattern_release(pattern);
+  return results_close(error, &results, ok);
+}
+
+#define REWRITE_BATCH 256
+
+// Changed nodes of a greplace() batch written back in one transaction. Values are read again inside it and
+// a node updated since it was scanned is replaced again, so restarts and concurrent updates are handled.
+typedef struct {
+  error_t *error;
+  walk_t *walk;
+  batch_t *batch;
+  pattern_t *pattern;
+  input_t *replace;
+  ydb_buffer_t value;
+  int changed;
+  int failed;  // the error is set, the transaction was rolled back
+} rewrite_t;
+
+static int rewrite_add(error_t *error, batch_t *batch, walk_t *walk, input_t *value, input_t *result) {
+  if (!batch_add(error, batch, walk, value)) {
+    return FAIL;
+  }
+  node_t *node = &batch->nodes[batch->count - 1];
+  node->replaced = batch->data.length;
+  node->replaced_length = result->length;
+  return buffer_append(error, &batch->data, result->address, result->length);
+}
+
+static int rewrite_commit(void *arg) {
+  rewrite_t *rewrite = arg;
+  error_t *error = rewrite->error;
+  batch_t *batch = rewrite->batch;
+  ydb_buffer_t *name = &rewrite->walk->root.name;
+  ydb_buffer_t subs[YDB_MAX_SUBS];
+  rewrite->changed = 0;
+  for (int i = 0; i < batch->count; i++) {
+    node_t *node = &batch->nodes[i];
+    batch_subs(batch, node, subs);
+    int status;
+    while ((status = ydb_get_s(name, node->count, subs, &rewrite->value)) == YDB_ERR_INVSTRLEN) {
+      char *address = realloc(rewrite->value.buf_addr, rewrite->value.len_used);
+      if (!address) {
+        error->number = E_MEM;
+        rewrite->failed = 1;
+        return YDB_TP_ROLLBACK;
+      }
+      rewrite->value.buf_addr = address;
+      rewrite->value.len_alloc = rewrite->value.len_used;
+    }
+    if (status == YDB_ERR_GVUNDEF || status == YDB_ERR_LVUNDEF) {
+      continue;  // killed since it was scanned
+    }
+    if (status != YDB_OK) {
+      return status;  // YDB_TP_RESTART included
+    }
+    input_t current = { .address = rewrite->value.buf_addr ? rewrite->value.buf_addr : "", .length = rewrite->value.len_used };
+    input_t result = { .address = batch->data.address + node->replaced, .length = node->replaced_length };
+    if (mem_eq(current.address, current.length, batch->data.address + node->value, node->length)) {
+      if (!pattern_substitute(error, rewrite->pattern, &current, rewrite->replace, &result)) {
+        rewrite->failed = 1;
+        return YDB_TP_ROLLBACK;
+      }
+      if (!mem_eq(result.address, result.length, current.address, current.length)) {
+        continue;
+      }
+    }
+    ydb_buffer_t value = { .buf_addr = result.address, .len_used = result.length, .len_alloc = result.length };
+    status = ydb_set_s(name, node->count, subs, &value);
+    if (status != YDB_OK) {
+      return status;
+    }
+    rewrite->changed++;
+  }
+  return YDB_OK;
+}
+
+static int rewrite_flush(rewrite_t *rewrite, int transaction) {
+  error_t *error = rewrite->error;
+  rewrite->failed = 0;
+  int status = transaction ? ydb_tp_s(rewrite_commit, rewrite, NULL, 0, NULL) : rewrite_commit(rewrite);
+  rewrite->batch->count = 0;
+  rewrite->batch->data.length = 0;
+  if (rewrite->failed) {
+    return FAIL;
+  }
+  if (status != YDB_OK) {
+    return ydb_error(error, status);
+  }
+  return OK;
+}
+
+// Replaces matches in the values of a subtree, only changed nodes are written back, in transactions
+// of up to batch nodes (0 writes them without transactions). Returns scanned,changed node counts.
+EXPORT gtm_string_t *greplace(int argc, input_t *gvn, input_t *search, input_t *replace, gtm_int_t batch) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 3) {
+    return ERROR_NULL(E_ARG);
+  }
+  if (argc < 4 || batch < 0) {
+    batch = REWRITE_BATCH;
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return NULL;
+  }
+  walk_t walk;
+  if (!walk_open(error, &walk, gvn)) {
+    pattern_release(pattern);
+    return NULL;
+  }
+  batch_t nodes = { .count = 0 };
+  rewrite_t rewrite = { .error = error, .walk = &walk, .batch = &nodes, .pattern = pattern, .replace = replace };
+  long scanned = 0;
+  long changed = 0;
+  int found = 1;
+  int ok = OK;
+  while (ok && found) {
+    ok = walk_next(error, &walk, &found);
+    if (ok && found) {
+      input_t value;
+      input_t result;
+      ok = walk_value(error, &walk, &value) && pattern_substitute(error, pattern, &value, replace, &result);
+      scanned += ok;
+      if (ok && mem_eq(result.address, result.length, value.address, value.length)) {
+        ok = rewrite_add(error, &nodes, &walk, &value, &result);
+      }
+    }
+    if (ok && nodes.count && (!found || nodes.count >= max(batch, 1) || nodes.data.length >= SCAN_BATCH_BYTES)) {
+      ok = rewrite_flush(&rewrite, batch > 0);
+      changed += rewrite.changed;
+    }
+  }
+  free(rewrite.value.buf_addr);
+  batch_free(&nodes);
+  walk_close(&walk);
+  pattern_release(pattern);
+  if (!ok) {
+    return NULL;
+  }
+  char counts[42];  // scanned,changed
+  int length = snprintf(counts, sizeof(counts), "%ld,%ld", scanned, changed);
+  return copy_mem(error, counts, length);
+}
+
+// Trigram index of the values in a subtree, kept in another (global or local) variable:
+//   ix("root")=name of the subtree, ix("ids")=last node id
+//   ix("node",id)=subscripts of the node below the root, packed like batch_t subscripts
+//   ix("id",subscripts below the root)=id of the node
+//   ix("t",trigram)=postings of the trigram, ix("t",trigram,id)=""
+// Trigrams are 3 bytes of a value with ASCII letters in lower case. A node updated by ixupdate() gets a new id,
+// postings of the old one are left behind (ix("node",old) is killed, so they are skipped) until the next ixbuild().
+typedef struct {
+  variable_t ix;
+  int base;             // subscripts of the index variable itself
+  variable_t root;
+  ydb_buffer_t value;   // ydb_get_s()/ydb_incr_s() result
+  buffer_t packed;
+  uint32_t *trigrams;   // sorted, unique
+  int count;
+  int size;
+} index_t;
+
+static void index_free(index_t *index) {
+  variable_free(&index->ix);
+  variable_free(&index->root);
+  free(index->value.buf_addr);
+  free(index->packed.address);
+  free(index->trigrams);
+  memset(index, '\0', sizeof(*index));
+}
+
+static int index_sub(error_t *error, index_t *index, int i, char *address, int length) {
+  if (index->base + i >= YDB_MAX_SUBS) {
+    return ERROR_FAIL(E_LIMIT);
+  }
+  return subscript_set(error, &index->ix.subs[index->base + i], address, length);
+}
+
+static int index_sub_int(error_t *error, index_t *index, int i, int n) {
+  char s[11];
+  char *p = s;
+  put_int(&p, n);
+  return index_sub(error, index, i, s, p - s);
+}
+
+static int index_sub_trigram(error_t *error, index_t *index, int i, uint32_t trigram) {
+  char s[3] = { trigram >> 16, trigram >> 8, trigram };
+  return index_sub(error, index, i, s, 3);
+}
+
+// Value of name(subs) into *value, *found is cleared for undefined nodes
+static int index_get(error_t *error, ydb_buffer_t *name, int count, ydb_buffer_t *subs, ydb_buffer_t *value, int *found) {
+  for (;;) {
+    int status = ydb_get_s(name, count, subs, value);
+    if (status == YDB_ERR_INVSTRLEN) {
+      char *address = realloc(value->buf_addr, value->len_used);
+      if (!address) {
+        return ERROR_FAIL(E_MEM);
+      }
+      value->buf_addr = address;
+      value->len_alloc = value->len_used;
+      continue;
+    }
+    *found = status == YDB_OK;
+    if (status == YDB_OK || status == YDB_ERR_GVUNDEF || status == YDB_ERR_LVUNDEF) {
+      return OK;
+    }
+    return ydb_error(error, status);
+  }
+}
+
+static int index_set(error_t *error, index_t *index, int count, char *address, int length) {
+  ydb_buffer_t value = { .buf_addr = address, .len_used = length, .len_alloc = length };
+  int status = ydb_set_s(&index->ix.name, index->base + count, index->ix.subs, &value);
+  return status == YDB_OK ? OK : ydb_error(error, status);
+}
+
+static int index_incr(error_t *error, index_t *index, int count, int *result) {
+  if (!subscript_reserve(error, &index->value, 0)) {
+    return FAIL;
+  }
+  int status = ydb_incr_s(&index->ix.name, index->base + count, index->ix.subs, NULL, &index->value);
+  if (status != YDB_OK) {
+    return ydb_error(error, status);
+  }
+  input_t value = { .address = index->value.buf_addr, .length = index->value.len_used };
+  if (!parse_int(&value, result, 10)) {
+    return ERROR_FAIL(E_LIMIT);
+  }
+  return OK;
+}
+
+static int index_open(error_t *error, index_t *index, input_t *ixgvn) {
+  memset(index, '\0', sizeof(*index));
+  if (!parse_variable(error, &index->ix, ixgvn)) {
+    return FAIL;
+  }
+  index->base = index->ix.count;
+  return OK;
+}
+
+// Reads the name of the indexed subtree from ix("root")
+static int index_root(error_t *error, index_t *index) {
+  int found;
+  if (!index_sub(error, index, 0, "root", 4) || !index_get(error, &index->ix.name, index->base + 1, index->ix.subs, &index->value, &found)) {
+    return FAIL;
+  }
+  if (!found) {
+    return ERROR_FAIL(E_NAME);
+  }
+  input_t root = { .address = index->value.buf_addr, .length = index->value.len_used };
+  return parse_variable(error, &index->root, &root);
+}
+
+static int trigram_compare(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static int index_push(error_t *error, index_t *index, uint32_t trigram) {
+  if (index->count == index->size) {
+    int size = max(index->size * 2, 64);
+    uint32_t *trigrams = realloc(index->trigrams, size * sizeof(*trigrams));
+    if (!trigrams) {
+      return ERROR_FAIL(E_MEM);
+    }
+    index->trigrams = trigrams;
+    index->size = size;
+  }
+  index->trigrams[index->count++] = trigram;
+  return OK;
+}
+
+static void index_unique(index_t *index) {
+  if (!index->count) {
+    return;
+  }
+  qsort(index->trigrams, index->count, sizeof(*index->trigrams), trigram_compare);
+  int n = 0;
+  for (int i = 0; i < index->count; i++) {
+    if (!n || index->trigrams[i] != index->trigrams[n - 1]) {
+      index->trigrams[n++] = index->trigrams[i];
+    }
+  }
+  index->count = n;
+}
+
+static int value_trigrams(error_t *error, index_t *index, input_t *value) {
+  index->count = 0;
+  uint32_t window = 0;
+  for (int i = 0; i < value->length; i++) {
+    window = ((window << 8) | tolower_ascii((unsigned char)value->address[i])) & 0xFFFFFF;
+    if (i >= 2 && !index_push(error, index, window)) {
+      return FAIL;
+    }
+  }
+  index_unique(index);
+  return OK;
+}
+
+// Skips a character class, or an escape with its argument (\x{..}, \k<..>, \p{..}), returns the next item
+static char *regex_skip(char *p, char *end) {
+  if (*p == '\\') {
+    for (p++; p < end && (isalpha(*p) || isdigit(*p)); p++) {
+    }
+    if (p < end && strchr("{<'", *p)) {
+      char *close = memchr(p, *p == '{' ? '}' : *p == '<' ? '>' : '\'', end - p);
+      p = close ? close + 1 : end;
+    }
+    return p;
+  }
+  p++;  // [
+  if (p < end && *p == '^') {
+    p++;
+  }
+  if (p < end && *p == ']') {
+    p++;
+  }
+  while (p < end && *p != ']') {
+    if (*p == '\\') {
+      p++;
+    } else if (*p == '[' && p + 1 < end && p[1] == ':') {
+      char *posix = memmem(p, end - p, ":]", 2);
+      if (posix) {
+        p = posix + 1;
+      }
+    }
+    p++;
+  }
+  return min(p + 1, end);
+}
+
+// Trigrams every match contains, from runs of literal characters at the top level of the regex. Groups,
+// classes and optional characters end a run, regexes with alternatives or extended parts give none.
+static int regex_trigrams(error_t *error, pattern_t *pattern, index_t *index) {
+  index->count = 0;
+  char *p = pattern->key + 1;
+  char *end = memrchr(p, '/', pattern->length - 1);
+  if (pattern->opts.x || regex_inline_option(p, end - p, 'x') || regex_alternatives(p, end)) {
+    return OK;
+  }
+  int unicase = pattern->utf8 && regex_caseless(pattern, p, end - p);  // k and s also match non-ASCII characters
+  uint32_t window = 0;
+  int run = 0;
+  while (p < end) {
+    char *c = p;
+    if (*p == '\\' && p + 1 < end && !isalpha(p[1]) && !isdigit(p[1])) {
+      c = p + 1;
+    } else if (*p == '\\' || *p == '[') {
+      p = regex_skip(p, end);
+      run = 0;
+      continue;
+    } else if (*p == '(') {
+      int depth = 0;
+      do {
+        if (*p == '\\' || *p == '[') {
+          p = regex_skip(p, end);
+          continue;
+        }
+        depth += (*p == '(') - (*p == ')');
+        p++;
+      } while (p < end && depth);
+      run = 0;
+      continue;
+    } else if (*p == '{') {
+      char *close = memchr(p, '}', end - p);
+      p = close ? close + 1 : end;
+      run = 0;
+      continue;
+    } else if (strchr("^$.|?*+)]}", *p)) {
+      p++;
+      run = 0;
+      continue;
+    }
+    char *next = c + 1;
+    while (pattern->utf8 && next < end && (*next & 0xC0) == 0x80) {
+      next++;
+    }
+    p = next;
+    if (next < end && strchr("?*{", *next)) {  // optional, the quantifier is skipped next
+      run = 0;
+      continue;
+    }
+    unsigned char unit = tolower_ascii((unsigned char)*c);
+    if (unicase && (unit >= 0x80 || unit == 'k' || unit == 's')) {
+      run = 0;
+      continue;
+    }
+    for (; c < next; c++) {
+      window = ((window << 8) | tolower_ascii((unsigned char)*c)) & 0xFFFFFF;
+      if (++run >= 3 && !index_push(error, index, window)) {
+        return FAIL;
+      }
+    }
+    if (next < end && *next == '+') {  // repeated, a run goes on from its last repetition
+      p++;
+      run = 1;
+      window &= 0xFF;
+    }
+  }
+  index_unique(index);
+  return OK;
+}
+
+// Adds a node (count subscripts, the root's included) with its value under a new id
+static int index_add(error_t *error, index_t *index, int count, ydb_buffer_t *subs, input_t *value) {
+  int below = count - index->root.count;
+  if (index->base + 1 + below > YDB_MAX_SUBS) {
+    return ERROR_FAIL(E_LIMIT);
+  }
+  int id;
+  if (!index_sub(error, index, 0, "ids", 3) || !index_incr(error, index, 1, &id)) {
+    return FAIL;
+  }
+  index->packed.length = 0;
+  for (int i = index->root.count; i < count; i++) {
+    int length = subs[i].len_used;
+    if (!buffer_append(error, &index->packed, (char *)&length, sizeof(length)) || !buffer_append(error, &index->packed, subs[i].buf_addr, length)) {
+      return FAIL;
+    }
+  }
+  if (!index_sub(error, index, 0, "node", 4) || !index_sub_int(error, index, 1, id) || !index_set(error, index, 2, index->packed.address ? index->packed.address : "", index->packed.length)) {
+    return FAIL;
+  }
+  if (!index_sub(error, index, 0, "id", 2)) {
+    return FAIL;
+  }
+  for (int i = 0; i < below; i++) {
+    if (!index_sub(error, index, 1 + i, subs[index->root.count + i].buf_addr, subs[index->root.count + i].len_used)) {
+      return FAIL;
+    }
+  }
+  char s[11];
+  char *p = s;
+  put_int(&p, id);
+  if (!index_set(error, index, 1 + below, s, p - s) || !value_trigrams(error, index, value) || !index_sub(error, index, 0, "t", 1)) {
+    return FAIL;
+  }
+  for (int i = 0; i < index->count; i++) {
+    int postings;
+    if (!index_sub_trigram(error, index, 1, index->trigrams[i]) || !index_incr(error, index, 2, &postings) || !index_sub_int(error, index, 2, id) || !index_set(error, index, 3, "", 0)) {
+      return FAIL;
+    }
+  }
+  return OK;
+}
+
+// The index must not hold or be held in the subtree, killing it would kill values
+static int index_overlaps(index_t *index) {
+  variable_t *ix = &index->ix;
+  variable_t *root = &index->root;
+  if (mem_eq(ix->name.buf_addr, ix->name.len_used, root->name.buf_addr, root->name.len_used)) {
+    return 0;
+  }
+  for (int i = 0; i < ix->count && i < root->count; i++) {
+    if (mem_eq(ix->subs[i].buf_addr, ix->subs[i].len_used, root->subs[i].buf_addr, root->subs[i].len_used)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Kills the index and indexes every node of the subtree, without a transaction
+EXPORT gtm_string_t *ixbuild(int argc, input_t *gvn, input_t *ixgvn) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return ERROR_NULL(E_ARG);
+  }
+  index_t index;
+  walk_t walk;
+  int ok = index_open(error, &index, ixgvn) && parse_variable(error, &index.root, gvn);
+  if (ok && index_overlaps(&index)) {
+    ok = ERROR_FAIL(E_NAME);
+  }
+  if (ok) {
+    int status = ydb_delete_s(&index.ix.name, index.base, index.ix.subs, YDB_DEL_TREE);
+    ok = status == YDB_OK ? OK : ydb_error(error, status);
+  }
+  ok = ok && index_sub(error, &index, 0, "root", 4) && index_set(error, &index, 1, gvn->address, gvn->length);
+  ok = ok && walk_open(error, &walk, gvn);
+  if (!ok) {
+    index_free(&index);
+    return NULL;
+  }
+  int nodes = 0;
+  int found = 1;
+  while (ok && found) {
+    ok = walk_next(error, &walk, &found);
+    if (!ok || !found) {
+      break;
+    }
+    input_t value;
+    ok = walk_value(error, &walk, &value) && index_add(error, &index, walk.count, walk.subs, &value);
+    nodes++;
+  }
+  walk_close(&walk);
+  index_free(&index);
+  if (!ok) {
+    return NULL;
+  }
+  char text[11];
+  input_t input = { .address = text };
+  char *p = text;
+  put_int(&p, nodes);
+  input.length = p - text;
+  return copy(error, &input);
+}
+
+typedef struct {
+  error_t *error;
+  index_t *index;
+  variable_t *node;
+  ydb_buffer_t value;
+  int indexed;
+  int failed;  // the error is set, the transaction was rolled back
+} update_t;
+
+static int update_commit(void *arg) {
+  update_t *update = arg;
+  error_t *error = update->error;
+  index_t *index = update->index;
+  variable_t *node = update->node;
+  int below = node->count - index->root.count;
+  int found;
+  update->indexed = 0;
+  int ok = index_sub(error, index, 0, "id", 2);
+  for (int i = 0; ok && i < below; i++) {
+    ok = index_sub(error, index, 1 + i, node->subs[index->root.count + i].buf_addr, node->subs[index->root.count + i].len_used);
+  }
+  ok = ok && index_get(error, &index->ix.name, index->base + 1 + below, index->ix.subs, &index->value, &found);
+  if (ok && found) {
+    input_t id = { .address = index->value.buf_addr, .length = index->value.len_used };
+    int status = ydb_delete_s(&index->ix.name, index->base + 1 + below, index->ix.subs, YDB_DEL_NODE);
+    if (status != YDB_OK) {
+      return status;
+    }
+    ok = index_sub(error, index, 0, "node", 4) && index_sub(error, index, 1, id.address, id.length);
+    status = ok ? ydb_delete_s(&index->ix.name, index->base + 2, index->ix.subs, YDB_DEL_NODE) : YDB_OK;
+    if (status != YDB_OK) {
+      return status;
+    }
+  }
+  ok = ok && index_get(error, &node->name, node->count, node->subs, &update->value, &found);
+  if (ok && found) {
+    input_t value = { .address = update->value.buf_addr ? update->value.buf_addr : "", .length = update->value.len_used };
+    ok = index_add(error, index, node->count, node->subs, &value);
+    update->indexed = 1;
+  }
+  if (!ok && error->number == E_YDB) {
+    int status = error->status;  // YDB_TP_RESTART included
+    clear_error(error, error->func);
+    return status;
+  }
+  if (!ok) {
+    update->failed = 1;
+    return YDB_TP_ROLLBACK;
+  }
+  return YDB_OK;
+}
+
+// Indexes the current value of one node of the subtree again (or drops it), in a transaction
+EXPORT gtm_string_t *ixupdate(int argc, input_t *ixgvn, input_t *name) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return ERROR_NULL(E_ARG);
+  }
+  index_t index;
+  variable_t node;
+  memset(&node, '\0', sizeof(node));
+  int ok = index_open(error, &index, ixgvn) && index_root(error, &index) && parse_variable(error, &node, name);
+  int below = ok && node.count >= index.root.count && !mem_eq(node.name.buf_addr, node.name.len_used, index.root.name.buf_addr, index.root.name.len_used);
+  for (int i = 0; below && i < index.root.count; i++) {
+    below = !mem_eq(node.subs[i].buf_addr, node.subs[i].len_used, index.root.subs[i].buf_addr, index.root.subs[i].len_used);
+  }
+  if (ok && !below) {
+    ok = ERROR_FAIL(E_NAME);
+  }
+  update_t update = { .error = error, .index = &index, .node = &node };
+  if (ok) {
+    int status = ydb_tp_s(update_commit, &update, NULL, 0, NULL);
+    if (!update.failed && status != YDB_OK) {
+      ok = ydb_error(error, status);
+    }
+    ok = ok && !update.failed;
+  }
+  free(update.value.buf_addr);
+  variable_free(&node);
+  index_free(&index);
+  if (!ok) {
+    return NULL;
+  }
+  input_t input = { .address = update.indexed ? "1" : "0", .length = 1 };
+  return copy(error, &input);
+}
+
+static int posting_compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Nodes whose value matches search, read only if the index has all trigrams of search for them. Results are
+// in id order, that is collation order after ixbuild(). Nodes changed without ixupdate() may be missed.
+EXPORT gtm_string_t *ixscan(int argc, input_t *ixgvn, input_t *search, gtm_int_t max, input_t *lvn) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return ERROR_NULL(E_ARG);
+  }
+  if (argc < 3 || max < 0) {
+    max = 0;
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return NULL;
+  }
+  pcre2_match_data *match_data = match_data_get(pattern->re);
+  results_t results;
+  int ok = match_data && results_open(error, &results, argc - 3, lvn);
+  if (!ok) {
+    if (match_data) {
+      match_data_put(match_data);
+    }
+    pattern_release(pattern);
+    return match_data ? NULL : ERROR_NULL(E_MEM);
+  }
+  index_t index;
+  uint64_t *postings = NULL;  // count << 24 | trigram, fewest postings first
+  ydb_buffer_t next = { .buf_addr = NULL };
+  ydb_buffer_t value = { .buf_addr = NULL };
+  buffer_t reference = { .address = NULL };
+  ok = index_open(error, &index, ixgvn) && index_root(error, &index) && regex_trigrams(error, pattern, &index);
+  int empty = 0;
+  if (ok && index.count) {
+    postings = malloc(index.count * sizeof(*postings));
+    ok = postings ? index_sub(error, &index, 0, "t", 1) : ERROR_FAIL(E_MEM);
+    for (int i = 0; ok && !empty && i < index.count; i++) {
+      int found;
+      ok = index_sub_trigram(error, &index, 1, index.trigrams[i]) && index_get(error, &index.ix.name, index.base + 2, index.ix.subs, &index.value, &found);
+      input_t count = { .address = index.value.buf_addr, .length = index.value.len_used };
+      int n = 0;
+      empty = ok && !found;
+      if (ok && found && !parse_int(&count, &n, 9)) {
+        n = INT_MAX;
+      }
+      postings[i] = (uint64_t)n << 24 | index.trigrams[i];
+    }
+    if (ok && !empty) {
+      qsort(postings, index.count, sizeof(*postings), posting_compare);
+    }
+  }
+  // ids come from the shortest posting list, or from ix("node") without trigrams
+  int level = index.count ? 2 : 1;
+  if (ok && !empty) {
+    ok = index_sub(error, &index, 0, index.count ? "t" : "node", index.count ? 1 : 4);
+    ok = ok && (!index.count || index_sub_trigram(error, &index, 1, postings[0] & 0xFFFFFF));
+    ok = ok && index_sub(error, &index, level, "", 0) && subscript_reserve(error, &next, 0);
+  }
+  ydb_buffer_t probe[YDB_MAX_SUBS];
+  char trigram[3];
+  memcpy(probe, index.ix.subs, index.base * sizeof(*probe));
+  probe[index.base] = (ydb_buffer_t){ .buf_addr = "t", .len_used = 1, .len_alloc = 1 };
+  probe[index.base + 1] = (ydb_buffer_t){ .buf_addr = trigram, .len_used = 3, .len_alloc = 3 };
+  ydb_buffer_t node[YDB_MAX_SUBS];
+  memcpy(node, index.root.subs, index.root.count * sizeof(*node));
+  while (ok && !empty && (!max || results.count < max)) {
+    ydb_buffer_t *cursor = &index.ix.subs[index.base + level];
+    int status = ydb_subscript_next_s(&index.ix.name, index.base + level + 1, index.ix.subs, &next);
+    if (status == YDB_ERR_NODEEND) {
+      break;
+    }
+    if (status == YDB_ERR_INVSTRLEN) {
+      ok = subscript_reserve(error, &next, next.len_used);
+      continue;
+    }
+    if (status != YDB_OK) {
+      ok = ydb_error(error, status);
+      break;
+    }
+    ydb_buffer_t swap = *cursor;
+    *cursor = next;
+    next = swap;
+    probe[index.base + 2] = *cursor;
+    int found = 1;
+    for (int i = 1; found && i < index.count; i++) {
+      unsigned int data;
+      uint32_t t = postings[i] & 0xFFFFFF;
+      trigram[0] = t >> 16;
+      trigram[1] = t >> 8;
+      trigram[2] = t;
+      status = ydb_data_s(&index.ix.name, index.base + 3, probe, &data);
+      if (status != YDB_OK) {
+        ok = ydb_error(error, status);
+      }
+      found = ok && data;
+    }
+    if (!ok || !found) {
+      continue;
+    }
+    probe[index.base] = (ydb_buffer_t){ .buf_addr = "node", .len_used = 4, .len_alloc = 4 };
+    probe[index.base + 1] = *cursor;
+    ok = index_get(error, &index.ix.name, index.base + 2, probe, &index.value, &found);
+    probe[index.base] = (ydb_buffer_t){ .buf_addr = "t", .len_used = 1, .len_alloc = 1 };
+    probe[index.base + 1] = (ydb_buffer_t){ .buf_addr = trigram, .len_used = 3, .len_alloc = 3 };
+    if (!ok || !found) {
+      continue;  // stale posting of an updated node
+    }
+    int count = index.root.count;
+    char *p = index.value.buf_addr;
+    char *end = p + index.value.len_used;
+    while (p + sizeof(int) <= end && count < YDB_MAX_SUBS) {
+      int length;
+      memcpy(&length, p, sizeof(length));
+      p += sizeof(length);
+      node[count++] = (ydb_buffer_t){ .buf_addr = p, .len_used = length, .len_alloc = length };
+      p += length;
+    }
+    ok = index_get(error, &index.root.name, count, node, &value, &found);
+    if (!ok || !found) {
+      continue;
+    }
+    input_t text = { .address = value.buf_addr ? value.buf_addr : "", .length = value.len_used };
+    int rc = regex_match(pattern, &text, 0, 0, match_data);
+    if (rc == PCRE2_ERROR_NOMATCH) {
+      continue;
+    }
+    if (rc < 0) {
+      ok = ERROR_FAIL(match_error(error, rc, E_MATCH));
+      break;
+    }
+    reference.length = 0;
+    ok = store_reference(error, &reference, &index.root.name, count, node) && results_add(error, &results, &reference);
+  }
+  free(postings);
+  free(next.buf_addr);
+  free(value.buf_addr);
+  free(reference.address);
+  index_free(&index);
+  match_data_put(match_data);
+  pattern_release(pattern);
+  return results_close(error, &results, ok);
+}
+
+// Read-only mapping of a whole file
+typedef struct {
+  char *address;
+  long length;
+} mapping_t;
+
+static int map_file(error_t *error, mapping_t *mapping, input_t *path) {
+  char name[PATH_MAX];
+  if (!path->length || path->length >= PATH_MAX || memchr(path->address, '\0', path->length)) {
+    return ERROR_FAIL(E_ARG);
+  }
+  memcpy(name, path->address, path->length);
+  name[path->length] = '\0';
+  mapping->address = "";
+  mapping->length = 0;
+  int fd = open(name, O_RDONLY);
+  struct stat st;
+  int ok = fd >= 0 && fstat(fd, &st) == 0;
+  if (ok && st.st_size) {
+    char *address = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = address != MAP_FAILED;
+    if (ok) {
+      madvise(address, st.st_size, MADV_SEQUENTIAL);
+      mapping->address = address;
+      mapping->length = st.st_size;
+    }
+  }
+  if (!ok) {
+    error_append(error, "%s: %m", name);  // errno.h would clash with error_t
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return ok ? OK : ERROR_FAIL(E_FILE);
+}
+
+static void unmap_file(mapping_t *mapping) {
+  if (mapping->length) {
+    munmap(mapping->address, mapping->length);
+  }
+}
+
+static int store_line(error_t *error, results_t *results, long line, long offset) {
+  char s[42];  // line,offset
+  int length = snprintf(s, sizeof(s), "%ld,%ld", line, offset + 1);
+  buffer_t result = { .address = s, .length = length, .size = sizeof(s) };
+  return results_add(error, results, &result);
+}
+
+// First match of every line, lines are matched in place without the trailing newline
+static int grep_lines(error_t *error, mapping_t *mapping, pattern_t *pattern, pcre2_match_data *data, int max, results_t *results) {
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(data);
+  char *end = mapping->address + mapping->length;
+  long line = 0;
+  for (char *p = mapping->address; p < end && (!max || results->count < max);) {
+    char *eol = memchr(p, '\n', end - p);
+    if (!eol) {
+      eol = end;
+    }
+    line++;
+    input_t text = { .address = p, .length = eol - p };
+    int rc = regex_match(pattern, &text, 0, 0, data);
+    if (rc >= 0) {
+      if (!store_line(error, results, line, p - mapping->address + ovector[0])) {
+        return FAIL;
+      }
+    } else if (rc != PCRE2_ERROR_NOMATCH) {
+      error_append(error, "line %ld: ", line);
+      return ERROR_FAIL(match_error(error, rc, E_MATCH));
+    }
+    p = eol + 1;
+  }
+  return OK;
+}
+
+// Every match in the whole file, matches may span lines
+static int grep_multiline(error_t *error, mapping_t *mapping, pattern_t *pattern, pcre2_match_data *data, int max, results_t *results) {
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(data);
+  input_t text = { .address = mapping->address, .length = mapping->length };
+  long line = 1;
+  char *counted = text.address;
+  int rc = regex_match(pattern, &text, 0, 0, data);
+  while (rc >= 0 && (!max || results->count < max)) {
+    char *start = text.address + ovector[0];
+    char *p;
+    while ((p = memchr(counted, '\n', start - counted))) {
+      line++;
+      counted = p + 1;
+    }
+    counted = start;
+    if (!store_line(error, results, line, ovector[0])) {
+      return FAIL;
+    }
+    rc = match_continue(pattern, &text, data);
+  }
+  if (rc < 0 && rc != PCRE2_ERROR_NOMATCH) {
+    return ERROR_FAIL(match_error(error, rc, E_MATCH));
+  }
+  return OK;
+}
+
+EXPORT gtm_string_t *grepfile(int argc, input_t *path, input_t *search, input_t *options, gtm_int_t max, input_t *lvn) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 2) {
+    return ERROR_NULL(E_ARG);
+  }
+  int multiline = 0;
+  if (argc > 2 && options->length) {
+    if (options->length > 1 || (options->address[0] != 'l' && options->address[0] != 'm')) {
+      return ERROR_NULL(E_OPT);
+    }
+    multiline = options->address[0] == 'm';
+  }
+  if (argc < 4 || max < 0) {
+    max = 0;
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return NULL;
+  }
+  pcre2_match_data *match_data = match_data_get(pattern->re);
+  results_t results;
+  mapping_t mapping;
+  int ok = match_data && results_open(error, &results, argc - 4, lvn);
+  if (!ok) {
+    if (match_data) {
+      match_data_put(match_data);
+    }
+    pattern_release(pattern);
+    return match_data ? NULL : ERROR_NULL(E_MEM);
+  }
+  ok = map_file(error, &mapping, path);
+  if (ok) {
+    if (multiline) {
+      ok = grep_multiline(error, &mapping, pattern, match_data, max, &results);
+    } else {
+      ok = grep_lines(error, &mapping, pattern, match_data, max, &results);
+    }
+    unmap_file(&mapping);
+  }
+  match_data_put(match_data);
+  pattern_release(pattern);
+  return results_close(error, &results, ok);
+}
+
+#define STORE_MAGIC "PCRESTOR"
+#define STORE_VERSION 2
+#define STORE_CALLOUT 1  // compiled with PCRE2_AUTO_CALLOUT, for a timeout
+
+// Patterns of a manifest serialized by pcre2_serialize_encode(), after the keys they were compiled from
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t count;
+  uint32_t keys;      // bytes of the keys, each a uint32_t length and the key, zero padded to 8
+  uint32_t checksum;  // FNV-1a of the keys and the serialized patterns
+  uint32_t reserved;
+  uint64_t size;      // bytes of the serialized patterns
+} store_header_t;
+
+// PCRE2 reads the serialized patterns through struct pointers, they start 8 byte aligned in the mapping
+#define STORE_ALIGN 8
+_Static_assert(sizeof(store_header_t) % STORE_ALIGN == 0, "store header breaks the alignment");
+
+static uint32_t store_flags(void) {
+  return limits.timeout ? STORE_CALLOUT : 0;
+}
+
+// Manifest lines are "/regex/opts" keys, empty lines and lines starting with # are skipped
+static int manifest_read(error_t *error, mapping_t *mapping, input_t **keys, int *count) {
+  *keys = NULL;
+  *count = 0;
+  int capacity = 0;
+  char *p = mapping->address;
+  char *end = p + mapping->length;
+  while (p < end) {
+    char *eol = memchr(p, '\n', end - p);
+    char *next = eol ? eol + 1 : end;
+    if (!eol) {
+      eol = end;
+    }
+    if (eol > p && eol[-1] == '\r') {
+      eol--;
+    }
+    if (eol > p && *p != '#') {
+      if (*count == capacity) {
+        capacity = max(capacity * 2, 64);
+        input_t *grown = realloc(*keys, capacity * sizeof(*grown));
+        if (!grown) {
+          free(*keys);
+          *keys = NULL;
+          return ERROR_FAIL(E_MEM);
+        }
+        *keys = grown;
+      }
+      input_t *key = &(*keys)[(*count)++];
+      key->address = p;
+      key->length = eol - p;
+    }
+    p = next;
+  }
+  return OK;
+}
+
+// Fails (without an error) when the store is not for these keys, or not for this PCRE2 build
+static int store_decode(mapping_t *store, input_t *keys, int count, pcre2_code **codes) {
+  store_header_t header;
+  if (store->length < (long)sizeof(header)) {
+    return FAIL;
+  }
+  memcpy(&header, store->address, sizeof(header));
+  if (memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) || header.version != STORE_VERSION || header.flags != store_flags()
+      || header.count != (uint32_t)count || (uint64_t)store->length != sizeof(header) + header.keys + header.size) {
+    return FAIL;
+  }
+  char *p = store->address + sizeof(header);
+  char *end = p + header.keys;
+  if (hash_mem(p, header.keys + header.size) != header.checksum) {
+    return FAIL;
+  }
+  for (int i = 0; i < count; i++) {
+    uint32_t length;
+    if (end - p < (long)sizeof(length)) {
+      return FAIL;
+    }
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    if ((uint32_t)(end - p) < length || mem_eq(p, length, keys[i].address, keys[i].length)) {
+      return FAIL;
+    }
+    p += length;
+  }
+  if (header.keys % STORE_ALIGN || end - p >= STORE_ALIGN) {
+    return FAIL;
+  }
+  for (; p < end; p++) {
+    if (*p) {
+      return FAIL;
+    }
+  }
+  return pcre2_serialize_decode(codes, count, (uint8_t *)end, memory.general) == count;
+}
+
+// Written to a temporary file renamed over path, so other processes read the old or the new file
+static int file_replace(error_t *error, input_t *path, char *address, long length) {
+  char name[PATH_MAX];
+  char temp[PATH_MAX + 16];
+  if (!path->length || path->length >= PATH_MAX || memchr(path->address, '\0', path->length)) {
+    return ERROR_FAIL(E_ARG);
+  }
+  memcpy(name, path->address, path->length);
+  name[path->length] = '\0';
+  snprintf(temp, sizeof(temp), "%s.%d", name, (int)getpid());
+  int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int ok = fd >= 0;
+  for (long done = 0; ok && done < length; ) {
+    ssize_t written = write(fd, address + done, length - done);
+    ok = written > 0;
+    done += written;
+  }
+  if (fd >= 0 && close(fd)) {
+    ok = 0;
+  }
+  ok = ok && rename(temp, name) == 0;
+  if (!ok) {
+    error_append(error, "%s: %m", name);  // errno.h would clash with error_t
+    if (fd >= 0) {
+      unlink(temp);
+    }
+  }
+  return ok ? OK : ERROR_FAIL(E_FILE);
+}
+
+static int store_write(error_t *error, input_t *path, input_t *keys, int count, pcre2_code **codes) {
+  uint8_t *bytes;
+  PCRE2_SIZE size;
+  int32_t rc = pcre2_serialize_encode((const pcre2_code **)codes, count, &bytes, &size, memory.general);
+  if (rc < 0) {
+    return ERROR_FAIL(rc == PCRE2_ERROR_NOMEMORY ? E_MEM : E_INTERNAL);
+  }
+  store_header_t header = { .version = STORE_VERSION, .flags = store_flags(), .count = count, .size = size };
+  memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+  buffer_t buffer = { .address = NULL };
+  int ok = buffer_reserve(error, &buffer, sizeof(header));
+  buffer.length = sizeof(header);
+  for (int i = 0; ok && i < count; i++) {
+    uint32_t length = keys[i].length;
+    ok = buffer_append(error, &buffer, (char *)&length, sizeof(length)) && buffer_append(error, &buffer, keys[i].address, keys[i].length);
+  }
+  static char padding[STORE_ALIGN];
+  long padded = (buffer.length - sizeof(header)) % STORE_ALIGN;
+  ok = ok && (!padded || buffer_append(error, &buffer, padding, STORE_ALIGN - padded));
+  header.keys = buffer.length - sizeof(header);
+  ok = ok && buffer_append(error, &buffer, (char *)bytes, size);
+  pcre2_serialize_free(bytes);
+  if (ok) {
+    header.checksum = hash_mem(buffer.address + sizeof(header), buffer.length - sizeof(header));
+    memcpy(buffer.address, &header, sizeof(header));
+    ok = file_replace(error, path, buffer.address, buffer.length);
+  }
+  free(buffer.address);
+  return ok;
+}
+
+// Decodes the manifest patterns from the store, or compiles them and (re)writes the store when it is
+// missing or stale, then caches them JIT-compiled. The store defaults to the manifest path with ".store".
+static int preload_patterns(error_t *error, input_t *manifest, input_t *store, int *loaded) {
+  *loaded = 0;
+  if (!cache.size) {
+    return OK;
+  }
+  char name[PATH_MAX];
+  input_t derived = { .address = name };
+  if (!store->length) {
+    if (manifest->length + 6 >= PATH_MAX) {
+      return ERROR_FAIL(E_ARG);
+    }
+    memcpy(name, manifest->address, manifest->length);
+    memcpy(name + manifest->length, ".store", 6);
+    derived.length = manifest->length + 6;
+    store = &derived;
+  }
+  mapping_t mapping;
+  if (!map_file(error, &mapping, manifest)) {
+    return FAIL;
+  }
+  input_t *keys;
+  int count;
+  int ok = manifest_read(error, &mapping, &keys, &count);
+  pcre2_code **codes = NULL;
+  if (ok && count) {
+    codes = calloc(count, sizeof(*codes));
+    ok = codes ? OK : ERROR_FAIL(E_MEM);
+  }
+  if (ok && count) {
+    mapping_t stored;
+    int decoded = FAIL;
+    if (map_file(error, &stored, store)) {
+      decoded = store_decode(&stored, keys, count, codes);
+      unmap_file(&stored);
+    }
+    clear_error(error, error->func);  // a missing store is built
+    for (int i = 0; ok && !decoded && i < count; i++) {
+      input_t regex;
+      regex_opts_t opts;
+      ok = parse_regex(error, &regex, &keys[i], &opts) && pattern_compile(error, &regex, &opts, &codes[i]);
+    }
+    ok = ok && (decoded || store_write(error, store, keys, count, codes));
+  }
+  for (int i = 0; i < count && codes; i++) {
+    input_t regex;
+    regex_opts_t opts;
+    uint32_t hash = hash_mem(keys[i].address, keys[i].length);
+    pattern_t *pattern;
+    if (!ok || cache_lookup(&keys[i], hash) || !parse_regex(error, &regex, &keys[i], &opts)) {
+      pcre2_code_free(codes[i]);
+      continue;
+    }
+    ok = pattern_create(error, &pattern, &keys[i], &regex, &opts, codes[i], hash);
+    if (!ok) {
+      continue;
+    }
+    pattern->uses = 0;
+    pattern->refs = 0;
+    pattern_jit(pattern);
+    cache_insert(pattern);
+    (*loaded)++;
+  }
+  free(codes);
+  free(keys);
+  unmap_file(&mapping);
+  return ok;
+}
+
+// Errors of the $pcre_preload manifest are reported by $&pcre.preload() with the same files
+static void preload_init(void) {
+  preload.initialized = 1;
+  char *manifest = getenv("pcre_preload");
+  if (!manifest || !*manifest) {
+    return;
+  }
+  char *store = getenv("pcre_preload_store");
+  error_t error;
+  clear_error(&error, "preload");
+  input_t manifest_input = { .address = manifest, .length = strlen(manifest) };
+  input_t store_input = { .address = store ? store : "", .length = store ? strlen(store) : 0 };
+  preload_patterns(&error, &manifest_input, &store_input, &preload.count);
+}
+
+EXPORT gtm_string_t *preload_control(int argc, input_t *manifest, input_t *store) {
+  error_t *error = &last_error;
+  clear_error(error, "preload");
+  if (!cache.initialized) {
+    cache_init();
+  }
+  if (!jit.initialized) {
+    jit_init();
+  }
+  if (!preload.initialized) {
+    preload_init();
+  }
+  if (argc < 1) {
+    return ERROR_NULL(E_ARG);
+  }
+  input_t none = { .address = "", .length = 0 };
+  int loaded;
+  if (!preload_patterns(error, manifest, argc < 2 ? &none : store, &loaded)) {
+    return NULL;
+  }
+  return int_string(error, loaded);
+}
+
+// Streaming matcher over a subject fed in chunks, only the tail that a match in progress
+// (or a lookbehind) may still need is kept between chunks
+struct stream {
+  pattern_t *pattern;
+  pcre2_match_data *data;
+  uint32_t lookbehind;  // characters kept before the next search start
+  buffer_t tail;
+  long base;            // subject offset of tail.address[0]
+  long start;           // subject offset of the next search
+  int empty;            // empty match at start, retry with PCRE2_NOTEMPTY_ATSTART
+};
+
+static void stream_free(stream_t *stream) {
+  match_data_put(stream->data);
+  pattern_release(stream->pattern);
+  free(stream->tail.address);
+  free(stream);
+}
+
+static stream_t *handle_stream(error_t *error, int handle) {
+  int i = handle_index(handle);
+  if (i < 0 || !handles.slots[i].stream) {
+    return ERROR_NULL(E_HANDLE);
+  }
+  return handles.slots[i].stream;
+}
+
+// Length of an incomplete UTF-8 sequence at the end of a chunk
+static int utf_incomplete(char *address, int length) {
+  for (int n = 1; n <= min(length, 3); n++) {
+    unsigned char c = address[length - n];
+    if ((c & 0xc0) != 0x80) {
+      int size = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+      return size > n ? n : 0;
+    }
+  }
+  return 0;
+}
+
+static int stream_match(stream_t *stream, input_t *text, PCRE2_SIZE offset, uint32_t options) {
+  matcher_deadline(&jit.matcher);
+  for (;;) {
+    int rc = pcre2_match(stream->pattern->re, (PCRE2_SPTR)text->address, text->length, offset, options, stream->data, jit.matcher.context);
+    if (rc != PCRE2_ERROR_JIT_STACKLIMIT || !jit_stack_grow(&jit.matcher)) {
+      return rc;
+    }
+  }
+}
+
+// Matches the tail from the search start, partial = more input may follow
+static int stream_run(error_t *error, stream_t *stream, int partial, buffer_t *output) {
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(stream->data);
+  input_t text = { .address = stream->tail.address ? stream->tail.address : "", .length = stream->tail.length };
+  if (partial && stream->pattern->utf8) {
+    text.length -= utf_incomplete(text.address, text.length);
+  }
+  PCRE2_SIZE offset = stream->start - stream->base;
+  uint32_t utf_check = 0;
+  int rc;
+  for (;;) {
+    uint32_t options = utf_check | (partial ? PCRE2_PARTIAL_HARD : 0);
+    if (stream->empty) {
+      options |= PCRE2_NOTEMPTY_ATSTART | PCRE2_ANCHORED;
+    }
+    rc = stream_match(stream, &text, offset, options);
+    utf_check = PCRE2_NO_UTF_CHECK;
+    if (rc == PCRE2_ERROR_NOMATCH && stream->empty) {
+      if (offset == (PCRE2_SIZE)text.length) {
+        break;
+      }
+      offset = advance(&text, offset, stream->pattern->utf8, stream->pattern->crlf);
+      stream->empty = 0;
+      continue;
+    }
+    if (rc < 0) {
+      break;
+    }
+    char s[42];  // start,end
+    int length = snprintf(s, sizeof(s), "%ld,%ld", stream->base + (long)ovector[0] + 1, stream->base + (long)ovector[1]);
+    if ((output->length && !buffer_append(error, output, "\n", 1)) || !buffer_append(error, output, s, length)) {
+      return FAIL;
+    }
+    if (output->length > MSTR_LIMIT) {
+      return ERROR_FAIL(E_LIMIT);
+    }
+    stream->empty = ovector[0] == ovector[1];
+    offset = ovector[1];
+  }
+  if (rc != PCRE2_ERROR_NOMATCH && rc != PCRE2_ERROR_PARTIAL) {
+    return ERROR_FAIL(match_error(error, rc, E_MATCH));
+  }
+  if (rc == PCRE2_ERROR_PARTIAL) {
+    offset = ovector[0];
+  } else if (!stream->empty) {
+    offset = text.length;
+  }
+  // keep at least one character, so ^ and \A don't match at a chunk boundary
+  PCRE2_SIZE keep = offset;
+  for (uint32_t n = 0; n < max(stream->lookbehind, 1u) && keep > 0; n++) {
+    keep--;
+    while (stream->pattern->utf8 && keep > 0 && (text.address[keep] & 0xc0) == 0x80) {
+      keep--;
+    }
+  }
+  stream->start = stream->base + offset;
+  stream->base += keep;
+  if (keep) {
+    stream->tail.length -= keep;
+    memmove(stream->tail.address, stream->tail.address + keep, stream->tail.length);
+  }
+  return OK;
+}
+
+static output_t *stream_output(error_t *error, buffer_t *output, int ok) {
+  output_t *result = NULL;
+  if (ok) {
+    result = output->length ? copy_mem(error, output->address, output->length) : empty_string(error);
+  }
+  free(output->address);
+  return result;
+}
+
+EXPORT gtm_string_t *streamopen(int argc, input_t *search) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 1) {
+    return ERROR_NULL(E_ARG);
+  }
+  stream_t *stream = calloc(1, sizeof(*stream));
+  if (!stream) {
+    return ERROR_NULL(E_MEM);
+  }
+  if (!regex_compile(error, &stream->pattern, search)) {
+    free(stream);
+    return NULL;
+  }
+  pattern_t *pattern = stream->pattern;
+  if (jit.available) {
+    pcre2_jit_compile(pattern->re, PCRE2_JIT_PARTIAL_HARD);  // pcre2_match() falls back to the interpreter on failure
+  }
+  pcre2_pattern_info(pattern->re, PCRE2_INFO_MAXLOOKBEHIND, &stream->lookbehind);
+  stream->data = match_data_get(pattern->re);
+  int handle;
+  if (!stream->data || !handle_open(error, &handle)) {
+    stream_free(stream);
+    return error->number ? NULL : ERROR_NULL(E_MEM);
+  }
+  handles.slots[handle_index(handle)].stream = stream;
+  return int_string(error, handle);
+}
+
+EXPORT gtm_string_t *feed(int argc, gtm_int_t handle, input_t *chunk) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  stream_t *stream = handle_stream(error, argc < 1 ? 0 : handle);
+  if (!stream) {
+    return NULL;
+  }
+  buffer_t output = { .address = NULL };
+  int ok = argc < 2 || buffer_append(error, &stream->tail, chunk->address, chunk->length);
+  ok = ok && stream_run(error, stream, 1, &output);
+  return stream_output(error, &output, ok);
+}
+
+// Reports matches left in the tail at the end of the subject and frees the handle
+EXPORT gtm_string_t *streamclose(int argc, gtm_int_t handle) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  stream_t *stream = handle_stream(error, argc < 1 ? 0 : handle);
+  if (!stream) {
+    return NULL;
+  }
+  buffer_t output = { .address = NULL };
+  int ok = stream_run(error, stream, 0, &output);
+  handle_close(handle_index(handle));
+  return stream_output(error, &output, ok);
+}
+
+// Patterns tested against one subject in a single call, a map of the bytes present in the subject
+// (one pass over it) rules out most patterns before their own prefilter or PCRE2 run
+struct set {
+  pattern_t **patterns;
+  int count;
+  int capacity;
+  int utf8;                // any UTF pattern
+  pcre2_match_data *data;  // one pair, only whether a pattern matches is needed
+};
+
+static void set_free(set_t *set) {
+  for (int i = 0; i < set->count; i++) {
+    pattern_release(set->patterns[i]);
+  }
+  free(set->patterns);
+  if (set->data) {
+    pcre2_match_data_free(set->data);
+  }
+  free(set);
+}
+
+static set_t *handle_set(error_t *error, int handle) {
+  int i = handle_index(handle);
+  if (i < 0 || !handles.slots[i].set) {
+    return ERROR_NULL(E_HANDLE);
+  }
+  return handles.slots[i].set;
+}
+
+static int byte_present(uint8_t *map, unsigned char c) {
+  return map[c >> 3] & (1 << (c & 7));
+}
+
+// The checks of literal_match() and prefilter_reject() against the byte map instead of the subject
+static int set_reject(pattern_t *pattern, uint8_t *map, long length) {
+  literal_t *literal = &pattern->literal;
+  if (literal->length) {
+    return length < literal->length
+      || !(byte_present(map, literal->first[0]) || byte_present(map, literal->first[1]))
+      || !(byte_present(map, literal->last[0]) || byte_present(map, literal->last[1]));
+  }
+  prefilter_t *prefilter = &pattern->prefilter;
+  if (!prefilter->enabled) {
+    return 0;
+  }
+  if (length < prefilter->length) {
+    return 1;
+  }
+  for (int i = 0; i < prefilter->units; i++) {
+    literal_t *required = &prefilter->required[i];
+    if (!byte_present(map, required->first[0]) && !byte_present(map, required->first[1])) {
+      return 1;
+    }
+  }
+  if (prefilter->bitmap) {
+    for (int i = 0; i < 32; i++) {
+      if (prefilter->first[i] & map[i]) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  return 0;
+}
+
+EXPORT gtm_string_t *setcreate(UNUSED int argc) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  set_t *set = calloc(1, sizeof(*set));
+  if (!set) {
+    return ERROR_NULL(E_MEM);
+  }
+  set->data = pcre2_match_data_create(1, memory.general);
+  int handle;
+  if (!set->data || !handle_open(error, &handle)) {
+    set_free(set);
+    return error->number ? NULL : ERROR_NULL(E_MEM);
+  }
+  handles.slots[handle_index(handle)].set = set;
+  return int_string(error, handle);
+}
+
+// Returns the index of the pattern in the set, from 1
+EXPORT gtm_string_t *setadd(int argc, gtm_int_t handle, input_t *search) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  set_t *set = handle_set(error, argc < 1 ? 0 : handle);
+  if (!set) {
+    return NULL;
+  }
+  if (argc < 2) {
+    return ERROR_NULL(E_ARG);
+  }
+  if (set->count == set->capacity) {
+    int capacity = max(set->capacity * 2, 16);
+    pattern_t **patterns = realloc(set->patterns, capacity * sizeof(*patterns));
+    if (!patterns) {
+      return ERROR_NULL(E_MEM);
+    }
+    set->patterns = patterns;
+    set->capacity = capacity;
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return NULL;
+  }
+  if (jit.available && !pattern->jit) {
+    pattern_jit(pattern);
+  }
+  set->utf8 |= pattern->utf8;
+  set->patterns[set->count++] = pattern;
+  return int_string(error, set->count);
+}
+
+// Mode "f" (default) returns the index of the first matching pattern (0 if none),
+// "a" the indexes of all matching patterns separated by commas, "c" their count
+EXPORT gtm_string_t *setmatch(int argc, gtm_int_t handle, input_t *text, input_t *mode) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  set_t *set = handle_set(error, argc < 1 ? 0 : handle);
+  if (!set) {
+    return NULL;
+  }
+  char m = 'f';
+  if (argc > 2 && mode->length) {
+    m = mode->address[0];
+    if (mode->length > 1 || (m != 'f' && m != 'a' && m != 'c')) {
+      return ERROR_NULL(E_OPT);
+    }
+  }
+  input_t null = { .address = "", .length = 0 };
+  if (argc < 2 || !text->address) {
+    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  }
+  uint8_t map[32] = { 0 };
+  unsigned char high = 0;
+  for (long i = 0; i < text->length; i++) {
+    unsigned char c = text->address[i];
+    map[c >> 3] |= 1 << (c & 7);
+    high |= c;
+  }
+  if (set->utf8 && high & 0x80 && !utf_validate(error, text, set->data)) {
+    return NULL;
+  }
+  buffer_t output = { .address = NULL };
+  int count = 0;
+  int first = 0;
+  int ok = OK;
+  for (int i = 0; ok && i < set->count; i++) {
+    pattern_t *pattern = set->patterns[i];
+    if (set_reject(pattern, map, text->length)) {
+      continue;
+    }
+    int rc = regex_match(pattern, text, 0, PCRE2_NO_UTF_CHECK, set->data);
+    if (rc == PCRE2_ERROR_NOMATCH) {
+      continue;
+    }
+    if (rc < 0) {
+      ok = ERROR_FAIL(match_error(error, rc, E_MATCH));
+      break;
+    }
+    if (!count++) {
+      first = i + 1;
+    }
+    if (m == 'f') {
+      break;
+    }
+    if (m == 'a') {
+      ok = (count == 1 || buffer_append(error, &output, ",", 1)) && buffer_append_int(error, &output, i + 1);
+    }
+  }
+  output_t *result = NULL;
+  if (ok) {
+    if (m == 'a') {
+      result = output.length ? copy_mem(error, output.address, output.length) : empty_string(error);
+    } else {
+      result = int_string(error, m == 'f' ? first : count);
+    }
+  }
+  free(output.address);
+  return result;
+}
+
+// End of the field starting at p, the end of the record for the last one
+static char *field_end(char *p, char *end, input_t *sep) {
+  char *found = memmem(p, end - p, sep->address, sep->length);
+  return found ? found : end;
+}
+
+// Fields of a record matching a pattern, as their indexes ("i"), the fields ("f") or a bitmap of 0 and 1 ("b").
+// Stops before a match over max or output over MSTR_LIMIT, next is then the field to continue from (0 at the end).
+EXPORT gtm_string_t *filter(int argc, input_t *record, input_t *fieldsep, input_t *search, input_t *mode, gtm_int_t max, gtm_int_t *next) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  if (argc < 3 || !fieldsep->length) {
+    return ERROR_NULL(E_ARG);
+  }
+  char m = 'i';
+  if (argc > 3 && mode->length) {
+    m = mode->address[0];
+    if (mode->length > 1 || (m != 'i' && m != 'f' && m != 'b')) {
+      return ERROR_NULL(E_OPT);
+    }
+  }
+  if (argc < 5 || max < 0) {
+    max = 0;
+  }
+  int field = argc < 6 || *next < 1 ? 1 : *next;
+  input_t null = { .address = "", .length = 0 };
+  if (!record->address) {
+    record = &null;  // pcre2_match() doesn't accept .address=NULL
+  }
+  pattern_t *pattern;
+  if (!regex_compile(error, &pattern, search)) {
+    return NULL;
+  }
+  pcre2_match_data *match_data = match_data_get(pattern->re);
+  if (!match_data) {
+    pattern_release(pattern);
+    return ERROR_NULL(E_MEM);
+  }
+  int ok = OK;
+  if (pattern->utf8 && !is_ascii(record->address, record->length)) {
+    // a valid separator splits a valid record into valid fields
+    ok = utf_validate(error, record, match_data) && (is_ascii(fieldsep->address, fieldsep->length) || utf_validate(error, fieldsep, match_data));
+  }
+  char *p = record->address;
+  char *end = p + record->length;
+  for (int i = 1; p && i < field; i++) {
+    char *e = field_end(p, end, fieldsep);
+    p = e == end ? NULL : e + fieldsep->length;
+  }
+  buffer_t output = { .address = NULL };
+  int count = 0;
+  int resume = 0;
+  while (ok && p) {
+    char *e = field_end(p, end, fieldsep);
+    input_t subject = { .address = p, .length = e - p };
+    int rc = regex_match(pattern, &subject, 0, PCRE2_NO_UTF_CHECK, match_data);
+    if (rc < 0 && rc != PCRE2_ERROR_NOMATCH) {
+      ok = ERROR_FAIL(match_error(error, rc, E_MATCH));
+      break;
+    }
+    int matched = rc >= 0;
+    if (matched && max && count == max) {
+      resume = field;
+      break;
+    }
+    long length = output.length;
+    if (m == 'b') {
+      ok = buffer_append(error, &output, matched ? "1" : "0", 1);
+    } else if (matched && m == 'i') {
+      ok = (!count || buffer_append(error, &output, ",", 1)) && buffer_append_int(error, &output, field);
+    } else if (matched) {
+      ok = (!count || buffer_append(error, &output, fieldsep->address, fieldsep->length)) && buffer_append(error, &output, subject.address, subject.length);
+    }
+    if (ok && output.length > MSTR_LIMIT) {
+      output.length = length;
+      resume = field;
+      break;
+    }
+    count += matched;
+    field++;
+    p = e == end ? NULL : e + fieldsep->length;
+  }
+  match_data_put(match_data);
+  pattern_release(pattern);
+  output_t *result = NULL;
+  if (ok) {
+    result = output.length ? copy_mem(error, output.address, output.length) : empty_string(error);
+    if (result && argc >= 6) {
+      *next = resume;
+    }
+  }
+  free(output.address);
+  return result;
+}
+
+// Lexer rules combined into one pattern anchored at the current offset, "(*MARK:n)" before
+// rule n tells which one matched, so every position is tried once whatever the rule count
+struct lexer {
+  input_t *names;
+  int count;
+  int capacity;
+  int z;               // rules are matched without UTF, -1 before the first rule
+  buffer_t rules;      // "(*MARK:1)(?i:regex1\E)|(*MARK:2)(?:regex2\E)..."
+  pattern_t *pattern;  // compiled when a rule is added
+};
+
+static void lexer_free(lexer_t *lexer) {
+  for (int i = 0; i < lexer->count; i++) {
+    free(lexer->names[i].address);
+  }
+  free(lexer->names);
+  free(lexer->rules.address);
+  if (lexer->pattern) {
+    pattern_release(lexer->pattern);
+  }
+  free(lexer);
+}
+
+static lexer_t *handle_lexer(error_t *error, int handle) {
+  int i = handle_index(handle);
+  if (i < 0 || !handles.slots[i].lexer) {
+    return ERROR_NULL(E_HANDLE);
+  }
+  return handles.slots[i].lexer;
+}
+
+static int lexer_compile(error_t *error, lexer_t *lexer) {
+  if (!lexer->count) {
+    return ERROR_FAIL(E_ARG);
+  }
+  // (?J) as rules may use the same group names, \G anchors the alternation at the offset
+  buffer_t key = { .address = NULL };
+  int ok = buffer_append(error, &key, "/(?J)\\G(?:", 10)
+    && buffer_append(error, &key, lexer->rules.address, lexer->rules.length)
+    && buffer_append(error, &key, lexer->z ? ")/z" : ")/", lexer->z ? 3 : 2);
+  if (ok) {
+    input_t search = { .address = key.address, .length = key.length };
+    ok = regex_compile(error, &lexer->pattern, &search);
+  }
+  free(key.address);
+  return ok;
+}
+
+// Rules are embedded in one pattern, which renumbers their groups and ends their comments with the
+// next rule: back references, subroutine calls, verbs ((*MARK) and start of pattern ones) and (?x) are left out
+static int lexrule_check(error_t *error, pcre2_code *re, input_t *regex) {
+  uint32_t backrefs;
+  pcre2_pattern_info(re, PCRE2_INFO_BACKREFMAX, &backrefs);
+  int ok = !backrefs && !regex_inline_option(regex->address, regex->length, 'x');
+  char *p = regex->address;
+  char *end = p + regex->length;
+  while (ok && p < end) {
+    if (*p == '\\' && p + 2 < end && p[1] == 'g' && (p[2] == '<' || p[2] == '\'')) {
+      ok = FAIL;
+    } else if (*p == '\\' || *p == '[') {
+      p = regex_skip(p, end);
+      continue;
+    } else if (*p == '(' && p + 1 < end && p[1] == '*') {
+      ok = FAIL;
+    } else if (*p == '(' && p + 2 < end && p[1] == '?') {
+      char c = p[2];
+      ok = !(isdigit(c) || c == '+' || c == 'R' || c == '&' || (c == 'P' && p + 3 < end && p[3] == '>')
+        || (c == '-' && p + 3 < end && isdigit(p[3])));
+    }
+    p++;
+  }
+  if (!ok) {
+    error_append(error, " in a lexer rule: back references, subroutine calls, verbs and (?x) are not supported");
+    return ERROR_FAIL(E_PATTERN);
+  }
+  return OK;
+}
+
+EXPORT gtm_string_t *lexcreate(UNUSED int argc) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  lexer_t *lexer = calloc(1, sizeof(*lexer));
+  if (!lexer) {
+    return ERROR_NULL(E_MEM);
+  }
+  lexer->z = -1;
+  int handle;
+  if (!handle_open(error, &handle)) {
+    lexer_free(lexer);
     return NULL;
   }
-  pcre2_pattern_info(context->re, PCRE2_INFO_CAPTURECOUNT, &context->groups);
-  input_t null = { .address = "", .length = 0 };
-  if (!text->address) {
-    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  handles.slots[handle_index(handle)].lexer = lexer;
+  return int_string(error, handle);
+}
+
+// Rules are tried in the order they were added, options i, m, s and x apply to the rule only,
+// z to all of them. Returns the number of the rule, from 1.
+EXPORT gtm_string_t *lexrule(int argc, gtm_int_t handle, input_t *name, input_t *search) {
+  error_t *error = &last_error;
+  clear_error(error, __func__);
+  lexer_t *lexer = handle_lexer(error, argc < 1 ? 0 : handle);
+  if (!lexer) {
+    return NULL;
   }
-  if (argc < 3) {
-    sep = &null;
+  if (argc < 3 || !name->length) {
+    return ERROR_NULL(E_ARG);
   }
-  context->data = pcre2_match_data_create_from_pattern(context->re, NULL);
-  int rc = pcre2_match(context->re, (PCRE2_SPTR)text->address, text->length, 0, 0, context->data, NULL);
-  if (rc < 0) {
-    clear_context(context);
-    if (rc == PCRE2_ERROR_NOMATCH) {
-      if (sep->length) {
-        return empty_string(error);
-      }
-      return int_string(error, 0);
-    }
-    error_append_pcre_message(error, rc);
-    return ERROR_NULL(E_MATCH);
+  input_t regex;
+  regex_opts_t opts = { 0 };
+  if (!parse_regex(error, &regex, search, &opts)) {
+    return NULL;
   }
-  if (opts.a) {
-    context->all = 1;
+  if (lexer->z >= 0 && lexer->z != opts.z) {
+    return ERROR_NULL(E_OPT);
   }
-  if (opts.v) {
-    context->vector = 1;
+  pcre2_code *re;  // compiled alone, so errors point into the rule
+  if (!pattern_compile(error, &regex, &opts, &re)) {
+    return NULL;
   }
-  if (opts.g) {
-    uint32_t options;
-    pcre2_pattern_info(context->re, PCRE2_INFO_ALLOPTIONS, &options);
-    if (options & PCRE2_UTF) {
-      context->utf8 = 1;
-    }
-    uint32_t newline;
-    pcre2_pattern_info(context->re, PCRE2_INFO_NEWLINE, &newline);
-    switch (newline) {
-      case PCRE2_NEWLINE_ANY:
-      case PCRE2_NEWLINE_CRLF:
-      case PCRE2_NEWLINE_ANYCRLF:
-        context->crlf = 1;
+  int embeddable = lexrule_check(error, re, &regex);
+  pcre2_code_free(re);
+  if (!embeddable) {
+    return NULL;
+  }
+  if (lexer->count == lexer->capacity) {
+    int capacity = max(lexer->capacity * 2, 16);
+    input_t *names = realloc(lexer->names, capacity * sizeof(*names));
+    if (!names) {
+      return ERROR_NULL(E_MEM);
     }
-    context->next = 1;
+    lexer->names = names;
+    lexer->capacity = capacity;
+  }
+  char flags[16] = "(?";
+  char *p = flags + 2;
+  if (opts.i) {
+    *p++ = 'i';
   }
-  if (!copy_input(error, &context->text, text)) {
-    clear_context(context);
+  if (opts.m) {
+    *p++ = 'm';
+  }
+  if (opts.s) {
+    *p++ = 's';
+  }
+  for (int i = 0; i < min(opts.x, 2); i++) {
+    *p++ = 'x';
+  }
+  *p++ = ':';
+  int length = lexer->rules.length;
+  int ok = (!lexer->count || buffer_append(error, &lexer->rules, "|", 1))
+    && buffer_append(error, &lexer->rules, "(*MARK:", 7)
+    && buffer_append_int(error, &lexer->rules, lexer->count + 1)
+    && buffer_append(error, &lexer->rules, ")", 1)
+    && buffer_append(error, &lexer->rules, flags, p - flags)
+    && buffer_append(error, &lexer->rules, regex.address, regex.length)
+    && buffer_append(error, &lexer->rules, opts.x ? "\n\\E)" : "\\E)", opts.x ? 4 : 3);  // ends a comment or \Q
+  input_t *copy = &lexer->names[lexer->count];
+  if (ok && !(copy->address = malloc(name->length))) {
+    ok = ERROR_FAIL(E_MEM);
+  }
+  if (!ok) {
+    lexer->rules.length = length;
     return NULL;
   }
-  if (sep->length) {
-    if (!copy_input(error, &context->sep, sep)) {
-      clear_context(context);
-      return NULL;
-    }
-    return match_record(error, context);
+  memcpy(copy->address, name->address, name->length);
+  copy->length = name->length;
+  lexer->count++;
+  int z = lexer->z;
+  lexer->z = opts.z;
+  pattern_t *previous = lexer->pattern;
+  lexer->pattern = NULL;
+  if (!lexer_compile(error, lexer)) {  // the combined pattern must compile as well
+    lexer->count--;
+    free(copy->address);
+    lexer->rules.length = length;
+    lexer->z = z;
+    lexer->pattern = previous;
+    return NULL;
   }
-  return int_string(error, 1);
+  if (previous) {
+    pattern_release(previous);
+  }
+  return int_string(error, lexer->count);
 }
 
-EXPORT gtm_int_t end(UNUSED int argc) {
-  context_t *context = &match_context;
-  return !context->next;
+static void tokens2record(output_t *output, lexer_t *lexer, PCRE2_SIZE *vectors, long count, input_t *sep, input_t *recordsep) {
+  int write = output->address != NULL;
+  char *p = output->address;
+  for (long i = 0; i < count; i += 2) {
+    if (i) {
+      store_mem(&p, recordsep->address, recordsep->length, write);
+    }
+    PCRE2_SIZE rule = vectors[2*i+2];
+    if (rule > 0 && rule <= (PCRE2_SIZE)lexer->count) {
+      store_mem(&p, lexer->names[rule - 1].address, lexer->names[rule - 1].length, write);
+    }
+    store_mem(&p, sep->address, sep->length, write);
+    store_vec(&p, vectors, i, sep, write);
+  }
+  output->length = p - output->address;
 }
 
-EXPORT gtm_string_t *next(UNUSED int argc) {
+// Tokens as "rule<sep>start<sep>end" records (M indexes like $&pcre.zvector()), separated by recordsep.
+// Text that no rule matches becomes a token with an empty rule name, empty matches are not tokens.
+EXPORT gtm_string_t *lex(int argc, gtm_int_t handle, input_t *text, input_t *sep, input_t *recordsep) {
   error_t *error = &last_error;
-  context_t *context = &match_context;
-  if (!context->next) {
-    return ERROR_NULL(E_END);
+  clear_error(error, __func__);
+  lexer_t *lexer = handle_lexer(error, argc < 1 ? 0 : handle);
+  if (!lexer) {
+    return NULL;
   }
-  input_t *text = &context->text;
-  input_t *sep = &context->sep;
-  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(context->data);
-  for (;;) {
-    uint32_t match_options = 0;
-    PCRE2_SIZE offset = ovector[1];
-    if (ovector[0] == ovector[1]) {
-      if ((int)ovector[0] == text->length) {
-        break;
-      }
-      match_options = PCRE2_NOTEMPTY_ATSTART | PCRE2_ANCHORED;
-    }
-    int rc = pcre2_match(context->re, (PCRE2_SPTR)text->address, text->length, offset, match_options, context->data, NULL);
+  input_t null = { .address = "", .length = 0 };
+  input_t comma = { .address = ",", .length = 1 };
+  input_t newline = { .address = "\n", .length = 1 };
+  if (argc < 2 || !text->address) {
+    text = &null;  // pcre2_match() doesn't accept .address=NULL
+  }
+  if (argc < 3) {
+    sep = &comma;
+  }
+  if (argc < 4) {
+    recordsep = &newline;
+  }
+  if (!lexer->pattern && !lexer_compile(error, lexer)) {
+    return NULL;
+  }
+  pattern_t *pattern = lexer->pattern;
+  if (jit.available && !pattern->jit) {
+    pattern_jit(pattern);
+  }
+  pcre2_match_data *match_data = match_data_get(pattern->re);
+  if (!match_data) {
+    return ERROR_NULL(E_MEM);
+  }
+  int ok = OK;
+  if (pattern->utf8 && !is_ascii(text->address, text->length)) {
+    ok = utf_validate(error, text, match_data);
+  }
+  // tokens are two pairs: start and end, then the rule (0 for unmatched text) twice
+  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
+  long count = 0;
+  PCRE2_SIZE offset = 0;
+  PCRE2_SIZE unmatched = PCRE2_UNSET;
+  while (ok && offset < (PCRE2_SIZE)text->length) {
+    int rc = regex_match(pattern, text, offset, PCRE2_NOTEMPTY_ATSTART | PCRE2_NO_UTF_CHECK, match_data);
     if (rc == PCRE2_ERROR_NOMATCH) {
-      if (!match_options) {
-        break;
-      }
-      ovector[1] = offset + 1;
-      if (context->crlf && (int)offset < text->length - 1 && text->address[offset] == '\r' && text->address[offset + 1] == '\n') {
-        ovector[1]++;
-      } else if (context->utf8) {
-        while ((int)ovector[1] < text->length) {
-          if ((text->address[ovector[1]] & 0xc0) != 0x80) {
-            break;
-          }
-          ovector[1]++;
-        }
+      if (unmatched == PCRE2_UNSET) {
+        unmatched = offset;
       }
+      offset = advance(text, offset, pattern->utf8, pattern->crlf);
       continue;
     }
     if (rc < 0) {
-      clear_context(context);
-      error_append_pcre_message(error, rc);
-      return ERROR_NULL(E_MATCH);
+      ok = ERROR_FAIL(match_error(error, rc, E_MATCH));
+      break;
     }
-    if (sep->length) {
-      return match_record(error, context);
+    if (unmatched != PCRE2_UNSET) {
+      ok = vectors_push(error, &count, unmatched, offset) && vectors_push(error, &count, 0, 0);
+      unmatched = PCRE2_UNSET;
     }
-    return int_string(error, 1);
+    PCRE2_SPTR mark = pcre2_get_mark(match_data);
+    PCRE2_SIZE rule = mark ? strtoul((char *)mark, NULL, 10) : 0;
+    ok = ok && vectors_push(error, &count, ovector[0], ovector[1]) && vectors_push(error, &count, rule, rule);
+    offset = ovector[1];
   }
-  if (sep->length) {
-    clear_context(context);
-    return empty_string(error);
+  if (ok && unmatched != PCRE2_UNSET) {
+    ok = vectors_push(error, &count, unmatched, offset) && vectors_push(error, &count, 0, 0);
   }
-  clear_context(context);
-  return int_string(error, 0);
+  match_data_put(match_data);
+  if (!ok) {
+    vectors_trim();
+    return NULL;
+  }
+  output_t *output = gtm_malloc(sizeof(*output));
+  if (!output) {
+    vectors_trim();
+    return ERROR_NULL(E_MEM);
+  }
+  output->address = NULL;
+  tokens2record(output, lexer, matchall_vectors.address, count, sep, recordsep);
+  if (output->length > MSTR_LIMIT) {
+    vectors_trim();
+    return ERROR_NULL(E_LIMIT);
+  }
+  output->address = gtm_malloc(max(output->length, 1));
+  if (!output->address) {
+    vectors_trim();
+    return ERROR_NULL(E_MEM);
+  }
+  tokens2record(output, lexer, matchall_vectors.address, count, sep, recordsep);
+  vectors_trim();
+  return output;
 }
 
-#define isdigit(n) \
-  ({ __typeof__ (n) _n = (n); \
-     _n >= '0' && _n <= '9'; })
+// Literal keys replaced by their values in one pass: an Aho-Corasick automaton over the reversed keys,
+// run from the end of the text, gives the longest key starting at every position, so the leftmost
+// longest matches are picked going forward. Keys map to their index through a hash table.
+typedef struct {
+  int child;    // first child state, 0 for none
+  int sibling;  // next child of the parent
+  int fail;     // state of the longest proper suffix
+  int key;      // longest key ending in this state, -1 for none
+  unsigned char byte;
+} map_state_t;
 
-static int parse_int(input_t *input, int *result, int max_digits) {
-  if (input->length > max_digits) {
-    return FAIL;
-  }
-  char *p = input->address;
-  char *q = p + input->length;
-  int n = 0;
-  while (p < q && isdigit(*p)) {
-    n *= 10;
-    n += *p - '0';
-    p++;
+struct map {
+  int caseless;  // ASCII letters, keys are stored folded
+  input_t *keys;
+  input_t *values;
+  int count;
+  int capacity;
+  uint32_t *slots;  // key index + 1, 0 for an empty slot
+  uint32_t mask;
+  map_state_t *states;  // built by replacemap() after keys were added, state 0 is the root
+  int root[256];        // transitions of the root, most bytes of the text don't leave it
+};
+
+static void map_states_free(map_t *map) {
+  free(map->states);
+  map->states = NULL;
+}
+
+static void map_free(map_t *map) {
+  for (int i = 0; i < map->count; i++) {
+    free(map->keys[i].address);
+    free(map->values[i].address);
   }
-  if (p < q) {
-    return FAIL;
+  free(map->keys);
+  free(map->values);
+  free(map->slots);
+  map_states_free(map);
+  free(map);
+}
+
+static map_t *handle_map(error_t *error, int handle) {
+  int i = handle_index(handle);
+  if (i < 0 || !handles.slots[i].map) {
+    return ERROR_NULL(E_HANDLE);
   }
-  *result = n;
-  return OK;
+  return handles.slots[i].map;
 }
 
-static int mem_eq(char *a, int a_length, char *b, int b_length) {
-  if (a_length != b_length) {
+static int map_find(map_t *map, char *key, int length) {
+  if (!map->slots) {
     return -1;
   }
-  return memcmp(a, b, a_length);
+  for (uint32_t k = hash_mem(key, length) & map->mask; map->slots[k]; k = (k + 1) & map->mask) {
+    input_t *other = &map->keys[map->slots[k] - 1];
+    if (!mem_eq(other->address, other->length, key, length)) {
+      return map->slots[k] - 1;
+    }
+  }
+  return -1;
 }
 
-static int name2i(context_t *context, input_t *name, int *i) {
-  if (!context->names.table) {
-    pcre2_pattern_info(context->re, PCRE2_INFO_NAMECOUNT, &context->names.count);
-    if (!context->names.count) {
-      return FAIL;
-    }
-    pcre2_pattern_info(context->re, PCRE2_INFO_NAMETABLE, &context->names.table);
-    pcre2_pattern_info(context->re, PCRE2_INFO_NAMEENTRYSIZE, &context->names.entry_size);
+static int map_rehash(error_t *error, map_t *map, uint32_t size) {
+  uint32_t *slots = calloc(size, sizeof(*slots));
+  if (!slots) {
+    return ERROR_FAIL(E_MEM);
   }
-  char *p = (char *)context->names.table;
-  for (uint32_t j = 0; j < context->names.count; j++) {
-    int n = (p[0] << 8) | p[1];
-    char *address = p + 2;  // IMM2_SIZE
-    int length = strlen(address);
-    if (!mem_eq(address, length, name->address, name->length)) {
-      *i = n;
-      return OK;
+  free(map->slots);
+  map->slots = slots;
+  map->mask = size - 1;
+  for (int i = 0; i < map->count; i++) {
+    uint32_t k = hash_mem(map->keys[i].address, map->keys[i].length) & map->mask;
+    while (map->slots[k]) {
+      k = (k + 1) & map->mask;
     }
-    p += context->names.entry_size;
+    map->slots[k] = i + 1;
   }
-  return FAIL;
+  return OK;
 }
 
-static output_t *vec_string(error_t *error, PCRE2_SIZE *ovector, int i, input_t *sep) {
-  output_t *output = gtm_malloc(sizeof(*output));
-  if (!output) {
-    return ERROR_NULL(E_MEM);
+static int map_child(map_t *map, int state, unsigned char c) {
+  if (!state) {
+    return map->root[c];
   }
-  output->address = NULL;
-  ovector2vec(output, ovector, i, sep);
-  output->address = gtm_malloc(max(output->length, 1));
-  if (!output->address) {
-    return ERROR_NULL(E_MEM);
+  for (int child = map->states[state].child; child; child = map->states[child].sibling) {
+    if (map->states[child].byte == c) {
+      return child;
+    }
   }
-  ovector2vec(output, ovector, i, sep);
-  return output;
+  return 0;
 }
 
-typedef enum {
-  GET_STRING,
-  GET_ISSET,
-  GET_ZVECTOR,
-} get_mode_t;
+static int map_next(map_t *map, int state, unsigned char c) {
+  for (;;) {
+    int child = map_child(map, state, c);
+    if (child || !state) {
+      return child;
+    }
+    state = map->states[state].fail;
+  }
+}
 
-static gtm_string_t *group_get(error_t *error, int argc, input_t *name, input_t *sep, get_mode_t mode) {
-  context_t *context = &match_context;
-  if (!context->re) {
-    return ERROR_NULL(E_END);
+static int map_build(error_t *error, map_t *map) {
+  long bytes = 1;
+  for (int i = 0; i < map->count; i++) {
+    bytes += map->keys[i].length;
   }
-  if (argc < 1 || !name->length) {
-    return ERROR_NULL(E_GROUP);
+  map->states = malloc(bytes * sizeof(*map->states));
+  if (!map->states) {
+    return ERROR_FAIL(E_MEM);
   }
-  int i;
-  if (!parse_int(name, &i, 4)) {
-    if (!name2i(context, name, &i)) {
-      return ERROR_NULL(E_GROUP);
+  memset(map->root, 0, sizeof(map->root));
+  map->states[0] = (map_state_t){ .key = -1 };
+  int count = 1;
+  for (int i = 0; i < map->count; i++) {
+    input_t *key = &map->keys[i];
+    int state = 0;
+    for (int j = key->length - 1; j >= 0; j--) {
+      unsigned char c = key->address[j];
+      int child = map_child(map, state, c);
+      if (!child) {
+        child = count++;
+        map->states[child] = (map_state_t){ .sibling = state ? map->states[state].child : 0, .key = -1, .byte = c };
+        if (state) {
+          map->states[state].child = child;
+        } else {
+          map->root[c] = child;
+        }
+      }
+      state = child;
     }
-  } else {
-    if (i >= (int)context->groups + 1) {
-      return ERROR_NULL(E_GROUP);
+    map->states[state].key = i;
+  }
+  // breadth first, so the fail state of a parent is known before its children
+  int *queue = malloc(count * sizeof(*queue));
+  if (!queue) {
+    map_states_free(map);
+    return ERROR_FAIL(E_MEM);
+  }
+  int head = 0;
+  int tail = 0;
+  for (int c = 0; c < 256; c++) {
+    if (map->root[c]) {
+      map->states[map->root[c]].fail = 0;
+      queue[tail++] = map->root[c];
     }
   }
-  int matches = (int)pcre2_get_ovector_count(context->data);
-  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(context->data);
-  switch (mode) {
-    case GET_STRING:
-      {
-        if (i >= matches) {
-          return empty_string(error);
-        }
-        input_t *text = &context->text;
-        char *address = text->address + ovector[2*i];
-        int length = ovector[2*i+1] - ovector[2*i];
-        return copy_mem(error, address, length);
-      }
-    case GET_ISSET:
-      {
-        if (i < matches && ovector[2*i] != PCRE2_UNSET) {
-          return int_string(error, 1);
-        }
-        return int_string(error, 0);
-      }
-    case GET_ZVECTOR:
-      {
-        if (i < matches && ovector[2*i] != PCRE2_UNSET) {
-          return vec_string(error, ovector, i, sep);
-        }
-        return empty_string(error);
+  while (head < tail) {
+    int state = queue[head++];
+    for (int child = map->states[state].child; child; child = map->states[child].sibling) {
+      map_state_t *s = &map->states[child];
+      s->fail = map_next(map, map->states[state].fail, s->byte);
+      if (s->key < 0) {
+        s->key = map->states[s->fail].key;  // a key ending here is longer than the one of any suffix
       }
+      queue[tail++] = child;
+    }
   }
-  return ERROR_NULL(E_INTERNAL);
+  free(queue);
+  return OK;
 }
 
-EXPORT gtm_string_t *get(int argc, input_t *name) {
+// Option "i" matches ASCII letters caseless
+EXPORT gtm_string_t *mapcreate(int argc, input_t *options) {
   error_t *error = &last_error;
   clear_error(error, __func__);
-  return group_get(error, argc, name, NULL, GET_STRING);
+  int caseless = 0;
+  if (argc > 0 && options->length) {
+    if (options->length > 1 || options->address[0] != 'i') {
+      return ERROR_NULL(E_OPT);
+    }
+    caseless = 1;
+  }
+  map_t *map = calloc(1, sizeof(*map));
+  if (!map) {
+    return ERROR_NULL(E_MEM);
+  }
+  map->caseless = caseless;
+  int handle;
+  if (!handle_open(error, &handle)) {
+    map_free(map);
+    return NULL;
+  }
+  handles.slots[handle_index(handle)].map = map;
+  return int_string(error, handle);
 }
 
-EXPORT gtm_string_t *isset(int argc, input_t *name) {
+// Adding a key again replaces its value. Returns the number of keys.
+EXPORT gtm_string_t *mapadd(int argc, gtm_int_t handle, input_t *key, input_t *value) {
   error_t *error = &last_error;
   clear_error(error, __func__);
-  return group_get(error, argc, name, NULL, GET_ISSET);
+  map_t *map = handle_map(error, argc < 1 ? 0 : handle);
+  if (!map) {
+    return NULL;
+  }
+  if (argc < 2 || !key->length) {
+    return ERROR_NULL(E_ARG);
+  }
+  input_t null = { .address = "", .length = 0 };
+  if (argc < 3) {
+    value = &null;
+  }
+  char *copy = malloc(key->length);
+  char *replacement = malloc(max(value->length, 1));
+  if (!copy || !replacement) {
+    free(copy);
+    free(replacement);
+    return ERROR_NULL(E_MEM);
+  }
+  for (int j = 0; j < key->length; j++) {
+    copy[j] = map->caseless ? tolower_ascii(key->address[j]) : key->address[j];
+  }
+  memcpy(replacement, value->address, value->length);
+  int i = map_find(map, copy, key->length);
+  if (i >= 0) {
+    free(copy);
+    free(map->values[i].address);
+    map->values[i].address = replacement;
+    map->values[i].length = value->length;
+    return int_string(error, map->count);
+  }
+  if (map->count == map->capacity) {
+    int capacity = max(map->capacity * 2, 16);
+    input_t *keys = realloc(map->keys, capacity * sizeof(*keys));
+    if (keys) {
+      map->keys = keys;
+    }
+    input_t *values = keys ? realloc(map->values, capacity * sizeof(*values)) : NULL;
+    if (!values) {
+      free(copy);
+      free(replacement);
+      return ERROR_NULL(E_MEM);
+    }
+    map->values = values;
+    map->capacity = capacity;
+  }
+  map->keys[map->count] = (input_t){ .address = copy, .length = key->length };
+  map->values[map->count] = (input_t){ .address = replacement, .length = value->length };
+  map->count++;
+  if ((uint32_t)map->count * 2 > map->mask + 1 && !map_rehash(error, map, max((map->mask + 1) * 2, 32u))) {
+    map->count--;
+    free(copy);
+    free(replacement);
+    return NULL;
+  }
+  uint32_t k = hash_mem(copy, key->length) & map->mask;
+  while (map->slots[k]) {
+    k = (k + 1) & map->mask;
+  }
+  map->slots[k] = map->count;
+  map_states_free(map);
+  return int_string(error, map->count);
 }
 
-EXPORT gtm_string_t *zvector(int argc, input_t *name, input_t *sep) {
+// Keys are replaced leftmost first, the longest one when several start at the same position,
+// and replaced text isn't scanned again
+EXPORT gtm_string_t *replacemap(int argc, input_t *text, gtm_int_t handle) {
   error_t *error = &last_error;
   clear_error(error, __func__);
-  input_t pipe = { .address = "|", .length = 1 };
-  if (argc < 2 || !sep->length) {
-    sep = &pipe;
+  map_t *map = handle_map(error, argc < 2 ? 0 : handle);
+  if (!map) {
+    return NULL;
+  }
+  input_t null = { .address = "", .length = 0 };
+  if (!text->address) {
+    text = &null;
+  }
+  if (!map->count) {
+    return copy_mem(error, text->address, text->length);
+  }
+  if (!map->states && !map_build(error, map)) {
+    return NULL;
   }
-  return group_get(error, argc, name, sep, GET_ZVECTOR);
+  // longest key starting at each position, pushed from the end of the text
+  long count = 0;
+  int state = 0;
+  for (long i = text->length - 1; i >= 0; i--) {
+    unsigned char c = text->address[i];
+    state = map_next(map, state, map->caseless ? tolower_ascii(c) : c);
+    if (map->states[state].key >= 0 && !vectors_push(error, &count, i, map->states[state].key)) {
+      vectors_trim();
+      return NULL;
+    }
+  }
+  PCRE2_SIZE *vectors = matchall_vectors.address;
+  output_t *output = gtm_malloc(sizeof(*output));
+  if (!output) {
+    vectors_trim();
+    return ERROR_NULL(E_MEM);
+  }
+  output->address = NULL;
+  for (int write = 0; write < 2; write++) {
+    char *p = output->address;
+    long position = 0;
+    for (long j = count - 1; j >= 0; j--) {
+      long start = vectors[2*j];
+      if (start < position) {
+        continue;
+      }
+      int key = vectors[2*j+1];
+      store_mem(&p, text->address + position, start - position, write);
+      store_mem(&p, map->values[key].address, map->values[key].length, write);
+      position = start + map->keys[key].length;
+    }
+    store_mem(&p, text->address + position, text->length - position, write);
+    output->length = p - output->address;
+    if (!write) {
+      if (output->length > MSTR_LIMIT) {
+        vectors_trim();
+        return ERROR_NULL(E_LIMIT);
+      }
+      output->address = gtm_malloc(max(output->length, 1));
+      if (!output->address) {
+        vectors_trim();
+        return ERROR_NULL(E_MEM);
+      }
+    }
+  }
+  vectors_trim();
+  return output;
 }
+
@@ -0,0 +1,317 @@
+; &pcre benchmarks
+;
+;   d ^pcrebench - runs all benchmarks
+;   d utf8Scaling^pcrebench - global match count on growing UTF-8 subjects, time per byte should stay flat
+;   d rejectCost^pcrebench - time per non-matching subject, rejected by the prefilter or by the matcher
+;   d replaceScans^pcrebench - one-pass global replace against the previous sizing pass followed by the replace
+;   d nativeCalls^pcrebench - time per call of the string returning entry points against the native ones
+;   d exportGroups^pcrebench - reading 40 named groups with $&pcre.get() against one $&pcre.export()
+;   d patternSet^pcrebench - routing a message through 300 patterns with $&pcre.test() against one $&pcre.setmatch()
+;   d filterFields^pcrebench - matching 10000 short fields with $&pcre.test() against one $&pcre.filter()
+;   d splitTokens^pcrebench - splitting a record with a $&pcre.match()/$&pcre.next() loop against one $&pcre.split()
+;   d lexTokens^pcrebench - tokenising with one anchored $&pcre.match() per rule and position against one $&pcre.lex()
+;   d replaceTerms^pcrebench - replacing 500 terms with one $&pcre.replace() per term against one $&pcre.replacemap()
+;   d rewriteNodes^pcrebench - rewriting 100000 global nodes with a $order()/$&pcre.replace() loop against one $&pcre.greplace()
+;   d keyRange^pcrebench - selecting 100 of 100000 subscripts with $&pcre.gkeys(), a caseless search reading every subscript against a sought literal prefix
+;   d indexSearch^pcrebench - finding 10 of 100000 values with $&pcre.gscan() against $&pcre.ixscan() over a trigram index (and the $&pcre.ixbuild() time)
+;
+
+pcrebench
+  d utf8Scaling
+  d rejectCost
+  d replaceScans
+  d nativeCalls
+  d exportGroups
+  d patternSet
+  d filterFields
+  d splitTokens
+  d lexTokens
+  d replaceTerms
+  d rewriteNodes
+  d keyRange
+  d indexSearch
+  q
+
+
+; Subject is validated once per $&pcre.test()/$&pcre.match() call, so counting matches is linear in subject size.
+
+utf8Scaling
+  n size,text,count,start,elapsed
+  w "Global match count on UTF-8 subjects (/\w+/g)",!
+  f size=65536,131072,262144,524288,1048576 d
+  . s text=$$subject("dąb ",size)
+  . s start=$$usec()
+  . s count=$&pcre.test(text,"/\w+/g")
+  . s elapsed=$$usec()-start
+  . d report($zl(text),count,elapsed)
+  q
+
+
+; Most filtered subjects don't match, patterns with required code units or a minimum length reject them
+; before pcre2_match() (and its UTF-8 validation), /timeout|refused/ has to run the matcher.
+
+rejectCost
+  n text,search,i,start,elapsed,count
+  s text=$$subject("lorem ipsum dolor sit amet, ",200)
+  w "Non-matching ",$zl(text)," byte subjects",!
+  f search="/ERROR: \d+/","/(?i)fatal.*disk/","/\d{4}-\d\d/","/timeout|refused/" d
+  . s count=0,start=$$usec()
+  . f i=1:1:100000 s count=count+$&pcre.test(text,search)
+  . s elapsed=$$usec()-start
+  . w $j(search,20)," ",$j(elapsed*1000/100000,8,0)," ns/subject",!
+  q
+
+
+; replace() substitutes into a reused buffer in one pass, the old PCRE2_SUBSTITUTE_OVERFLOW_LENGTH dry run sizing
+; the result scanned the subject twice. That dry run is not reachable from M on its own, so the previous approach is
+; timed as a global match count (the same scan and matches, no output) followed by the replace; the one-pass replace
+; should take about half of it.
+
+replaceScans
+  n size,text,count,start,elapsed,result,replaced,previous
+  w "Global replace against a sizing pass followed by the replace (/\b\w{3}\b/g)",!
+  f size=65536,131072,262144,524288 d
+  . s text=$$subject("fox jumps over the lazy dog ",size)
+  . s start=$$usec()
+  . s count=$&pcre.test(text,"/\b\w{3}\b/g")
+  . s elapsed=$$usec()-start
+  . s start=$$usec()
+  . s count=$&pcre.test(text,"/\b\w{3}\b/g")
+  . s result=$&pcre.replace(text,"/\b\w{3}\b/g","cat")
+  . s previous=$$usec()-start
+  . s start=$$usec()
+  . s result=$&pcre.replace(text,"/\b\w{3}\b/g","cat")
+  . s replaced=$$usec()-start
+  . d report($zl(text),count,elapsed)
+  . w $j("",8)," previous ",$j(previous,10)," us",!
+  . w $j("",8)," replace ",$j(replaced,10)," us ",$j(replaced/$s(previous:previous,1:1),8,2)," x previous",!
+  q
+
+
+; The native entry points return gtm_int_t and write to preallocated outputs, so a call allocates nothing.
+
+nativeCalls
+  n text,i,start,elapsed,native,out,rc
+  s text="2024-05-01 12:00:00 host=db01 status=ok"
+  w "Calls on a ",$zl(text)," byte subject",!
+  s start=$$usec()
+  f i=1:1:100000 s rc=$&pcre.test(text,"/status=ok/")
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  f i=1:1:100000 s rc=$&pcre.testn(text,"/status=ok/")
+  s native=$$usec()-start
+  d nativeReport("test",elapsed,native)
+  s start=$$usec()
+  f i=1:1:100000 s out=$&pcre.match(text,"/host=(\w+) status=(\w+)/",",")
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  f i=1:1:100000 s rc=$&pcre.matchn(text,"/host=(\w+) status=(\w+)/",",",.out)
+  s native=$$usec()-start
+  d nativeReport("match",elapsed,native)
+  q
+
+nativeReport(name,elapsed,native)
+  w $j(name,8)," ",$j(elapsed*1000/100000,8,0)," ns/call, native ",$j(native*1000/100000,8,0)," ns/call",!
+  q
+
+
+; Group names are hashed once per compiled pattern, $&pcre.export() sets every group in one call.
+
+exportGroups
+  n search,text,i,j,start,elapsed,exported,fields
+  s search="/",text=""
+  f i=1:1:40 s search=search_"(?<f"_i_">\w+)\|",text=text_"field"_i_"|"
+  s search=search_"/"
+  w "Reading 40 named groups of a match",!
+  s start=$$usec()
+  f i=1:1:10000 i $&pcre.match(text,search) f j=1:1:40 s fields("f"_j)=$&pcre.get("f"_j)
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  f i=1:1:10000 i $&pcre.match(text,search),$&pcre.export("fields")
+  s exported=$$usec()-start
+  w $j("get",8)," ",$j(elapsed*1000/10000,8,0)," ns/match",!
+  w $j("export",8)," ",$j(exported*1000/10000,8,0)," ns/match",!
+  q
+
+
+; A pattern set skips patterns whose required bytes are missing from the message, without an external call per pattern.
+
+patternSet
+  n handle,text,i,j,start,elapsed,set,count
+  s handle=$&pcre.setcreate()
+  f i=1:1:300 i $&pcre.setadd(handle,"/route"_i_":\d+/")
+  s text="lorem ipsum dolor sit amet, consectetur adipiscing elit 12345 route"
+  w "Routing a ",$zl(text)," byte message through 300 patterns",!
+  s start=$$usec()
+  f i=1:1:1000 s count=0 f j=1:1:300 s count=count+$&pcre.test(text,"/route"_j_":\d+/")
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  f i=1:1:1000 s count=$&pcre.setmatch(handle,text,"c")
+  s set=$$usec()-start
+  w $j("test",8)," ",$j(elapsed/1000,8,1)," us/message",!
+  w $j("set",8)," ",$j(set/1000,8,1)," us/message",!
+  i $&pcre.hfree(handle)
+  q
+
+
+
+; Every $&pcre.test() is an external call, $&pcre.filter() splits the record and matches it in one.
+
+filterFields
+  n record,field,i,start,elapsed,filter,count
+  s record="" f i=1:1:10000 s field(i)="ID"_(i*7919#100000),record=record_$s(i>1:",",1:"")_field(i)
+  w "Filtering ",$l(record,",")," fields (/^ID\d*7$/)",!
+  s start=$$usec()
+  s count=0 f i=1:1:10000 s count=count+$&pcre.test(field(i),"/^ID\d*7$/")
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  s count=$l($&pcre.filter(record,",","/^ID\d*7$/"),",")
+  s filter=$$usec()-start
+  w $j("test",8)," ",$j(elapsed/10000*1000,8,1)," ns/field",!
+  w $j("filter",8)," ",$j(filter/10000*1000,8,1)," ns/field",!
+  q
+
+
+; A $&pcre.next() loop makes an external call and allocates a string per token, $&pcre.split() one for all.
+
+splitTokens
+  n text,i,start,elapsed,split,count,previous,result
+  s text=$$subject("field;value, other ; x;",65536)
+  w "Splitting ",$zl(text)," bytes (/\s*[;,]\s*/)",!
+  s start=$$usec()
+  s result="",previous=1,count=0
+  i $&pcre.match(text,"/\s*[;,]\s*/g") f  d  q:'$&pcre.next()
+  . s i=$&pcre.zvector(0,"|"),count=count+1
+  . s result=result_$ze(text,previous,$p(i,"|",1)-1)_"|",previous=$p(i,"|",2)+1
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  s result=$&pcre.split(text,"/\s*[;,]\s*/","|")
+  s split=$$usec()-start
+  w $j("next",8)," ",$j(elapsed/count*1000,8,1)," ns/token",!
+  w $j("split",8)," ",$j(split/count*1000,8,1)," ns/token",!
+  q
+
+
+; Trying every rule at every position costs an external call per rule, the lexer's alternation tries each position once.
+
+lexTokens
+  n text,handle,rules,i,j,offset,start,elapsed,lex,count,token
+  s text=$$subject("MSH|12.5^abc~2024|",16384)
+  s rules(1)="/^[A-Z]{3}/",rules(2)="/^[|^~]/",rules(3)="/^\d+(?:\.\d+)?/",rules(4)="/^[a-z]+/"
+  s handle=$&pcre.lexcreate()
+  f i=1:1:4 i $&pcre.lexrule(handle,"r"_i,$e(rules(i),1)_$e(rules(i),3,$l(rules(i))))
+  w "Tokenising ",$zl(text)," bytes with 4 rules",!
+  s start=$$usec()
+  s offset=1,count=0
+  f  q:offset>$l(text)  d
+  . f j=1:1:4 s token=$$tokenLength($e(text,offset,offset+15),rules(j)) q:token
+  . s offset=offset+$s(token:token,1:1),count=count+1
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  s lex=$&pcre.lex(handle,text)
+  s lex=$$usec()-start
+  w $j("match",8)," ",$j(elapsed/count*1000,8,1)," ns/token",!
+  w $j("lex",8)," ",$j(lex/count*1000,8,1)," ns/token",!
+  i $&pcre.hfree(handle)
+  q
+
+tokenLength(text,search) ; length of the match at the start of text, 0 if none
+  q:'$&pcre.match(text,search) 0
+  q $p($&pcre.zvector(0,"|"),"|",2)
+
+
+; Every $&pcre.replace() scans the whole text, a map scans it once for all of its keys.
+
+replaceTerms
+  n text,handle,i,start,elapsed,map,result
+  s text=$$subject("lorem ipsum T042 dolor T317 sit amet ",524288)
+  s handle=$&pcre.mapcreate()
+  f i=1:1:500 i $&pcre.mapadd(handle,"T"_$e(1000+i,2,4),"<"_i_">")
+  w "Replacing 500 terms in ",$zl(text)," bytes",!
+  s start=$$usec()
+  s result=text f i=1:1:500 s result=$&pcre.replace(result,"/T"_$e(1000+i,2,4)_"/g","<"_i_">")
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  s result=$&pcre.replacemap(text,handle)
+  s map=$$usec()-start
+  w $j("replace",8)," ",$j(elapsed/1000,10,1)," ms",!
+  w $j("map",8)," ",$j(map/1000,10,1)," ms",!
+  i $&pcre.hfree(handle)
+  q
+
+
+; An M loop crosses the call-in boundary once per node, greplace() walks the subtree and sets changed nodes in batched transactions.
+
+rewriteNodes
+  n i,node,start,elapsed,rewrite,result
+  k ^pcrebench
+  f i=1:1:100000 s ^pcrebench(i)=$s(i#10:"status ok",1:"status ERROR")
+  w "Rewriting 100000 nodes (/ERROR/ -> FAILED)",!
+  s start=$$usec()
+  s node="" f  s node=$o(^pcrebench(node)) q:node=""  s result=$&pcre.replace(^pcrebench(node),"/ERROR/","FAILED") s:result'=^pcrebench(node) ^pcrebench(node)=result
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  s result=$&pcre.greplace("^pcrebench","/FAILED/","ERROR")
+  s rewrite=$$usec()-start
+  w $j("loop",8)," ",$j(elapsed/1000,10,1)," ms",!
+  w $j("greplace",8)," ",$j(rewrite/1000,10,1)," ms (",result,")",!
+  k ^pcrebench
+  q
+
+
+; An anchored literal prefix is sought, so the time should depend on the matching range and not on the global size.
+; The caseless search has no usable prefix and reads every subscript.
+
+keyRange
+  n i,start,elapsed,seek,result
+  k ^pcrebench
+  f i=1:1:100000 s ^pcrebench("ACCT-"_(2000+(i#1000))_"-"_i)=""
+  w "Selecting 100 of 100000 subscripts (/^ACCT-2024-\d+$/)",!
+  s start=$$usec()
+  s result=$&pcre.gkeys("^pcrebench","/^ACCT-2024-\d+$/i",0,"seek")
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  s result=$&pcre.gkeys("^pcrebench","/^ACCT-2024-\d+$/",0,"seek")
+  s seek=$$usec()-start
+  w $j("all",8)," ",$j(elapsed/1000,10,1)," ms",!
+  w $j("prefix",8)," ",$j(seek/1000,10,1)," ms (",result," found)",!
+  k ^pcrebench
+  q
+
+
+; ixscan() reads only the nodes holding all trigrams of the search, so its time follows the candidates and not the node count.
+; The index is built once and should pay for itself after a few searches.
+
+indexSearch
+  n i,start,build,elapsed,indexed,result
+  k ^pcrebench,^pcrebenchix
+  f i=1:1:100000 s ^pcrebench(i)="order "_i_" shipped to warehouse "_(i#97)_$s(i#10000:"",1:" flagged for audit")
+  w "Finding 10 of 100000 values (/flagged for audit/)",!
+  s start=$$usec()
+  s result=$&pcre.ixbuild("^pcrebench","^pcrebenchix")
+  s build=$$usec()-start
+  s start=$$usec()
+  s result=$&pcre.gscan("^pcrebench","/flagged for audit/",0,"indexed")
+  s elapsed=$$usec()-start
+  s start=$$usec()
+  s result=$&pcre.ixscan("^pcrebenchix","/flagged for audit/",0,"indexed")
+  s indexed=$$usec()-start
+  w $j("ixbuild",8)," ",$j(build/1000,10,1)," ms",!
+  w $j("gscan",8)," ",$j(elapsed/1000,10,1)," ms",!
+  w $j("ixscan",8)," ",$j(indexed/1000,10,1)," ms (",result," found)",!
+  k ^pcrebench,^pcrebenchix
+  q
+
+subject(unit,size) ; unit repeated up to size bytes
+  n text
+  s text="",$p(text,unit,size\$zl(unit)+1)=""
+  q text
+
+usec()
+  n h
+  s h=$zh
+  q ($p(h,",",1)*86400+$p(h,",",2))*1000000+$p(h,",",3)
+
+report(size,count,elapsed)
+  w $j(size,8)," bytes ",$j(count,8)," matches ",$j(elapsed,10)," us ",$j(elapsed*1000/size,8,1)," ns/byte",!
+  q
@@ -9,8 +9,43 @@
 ;     $&pcre.get(indexOrGroupName) - returns matched substring
 ;     $&pcre.zvector(indexOrGroupName,separator) - returns firstIndex|lastIndex like in $ZExtract() for matched substring
 ;     $&pcre.isset(indexOrGroupName) - returns 1 if capture group was set during matching
+;     $&pcre.export(name,separator) - sets name(indexOrGroupName) for every set capture group, with zvectors in name(indexOrGroupName,"z")
 ;     &&pcre.next() - continues matching
 ;     $&pcre.end() - checks if there are (no) more matches possible
+;   $&pcre.hmatch(text,search,separator) - like $&pcre.match() but returns a handle (0 if not matched), for independent matches
+;     $&pcre.hrecord(handle) - returns current match as a record
+;     $&pcre.hget(handle,indexOrGroupName), $&pcre.hisset(handle,indexOrGroupName), $&pcre.hzvector(handle,indexOrGroupName,separator)
+;     $&pcre.hexport(handle,name,separator) - like $&pcre.export()
+;     $&pcre.hnext(handle), $&pcre.hend(handle) - continue matching, the handle is freed when there are no more matches
+;     $&pcre.hfree(handle) - frees the handle
+;   $&pcre.matchall(text,search,fieldSeparator,recordSeparator,max,.offset) - returns all (or max) matches in one record
+;   $&pcre.split(text,search,outputSeparator,limit,groups) - returns text between matches (and capture groups) joined by outputSeparator (default ","), like Perl's split()
+;   $&pcre.testn(), $&pcre.replacen(), $&pcre.matchn(), $&pcre.nextn(), $&pcre.getn(), $&pcre.issetn(), $&pcre.zvectorn(),
+;   $&pcre.hmatchn(), $&pcre.hrecordn(), $&pcre.hnextn(), $&pcre.hgetn(), $&pcre.hissetn(), $&pcre.hzvectorn()
+;     - like the calls without "n" but return an integer (-1 on errors) and strings in a last .output argument
+;   $&pcre.gscan(name,search,max,resultName,threads) - returns references to nodes of a (global or local) variable subtree with values matching search
+;   $&pcre.greplace(name,search,replace,batch) - replaces matches in the values of a variable subtree in place, returns scanned,changed node counts
+;   $&pcre.gkeys(name,search,max,resultName) - returns references to nodes directly below a variable with subscripts matching search
+;   $&pcre.ixbuild(name,indexName) - builds a trigram index of the values of a variable subtree in indexName, returns the node count
+;     $&pcre.ixupdate(indexName,node) - indexes the current value of one node again, returns 1 (0 if it has no value)
+;     $&pcre.ixscan(indexName,search,max,resultName) - like gscan() but reads only nodes with all trigrams of search
+;   $&pcre.grepfile(path,search,mode,max,resultName) - returns line,offset of matches in a file, line by line (mode "l") or across lines (mode "m")
+;   $&pcre.streamopen(search) - returns a handle of a streaming matcher over a subject fed in chunks
+;     $&pcre.feed(handle,chunk) - returns start,end of complete matches, one per line
+;     $&pcre.streamclose(handle) - returns the remaining matches at the end of the subject and frees the handle
+;   $&pcre.setcreate() - returns a handle of a pattern set, freed with $&pcre.hfree()
+;     $&pcre.setadd(handle,search) - adds a pattern, returns its index in the set
+;     $&pcre.setmatch(handle,text,mode) - returns the first ("f") or all ("a") matching pattern indexes, or their count ("c")
+;   $&pcre.lexcreate() - returns a handle of a lexer, freed with $&pcre.hfree()
+;     $&pcre.lexrule(handle,name,search) - adds a token rule, returns its number
+;     $&pcre.lex(handle,text,separator,recordSeparator) - returns rule,start,end of every token, one per line
+;   $&pcre.mapcreate(options) - returns a handle of a replacement map, freed with $&pcre.hfree()
+;     $&pcre.mapadd(handle,key,value) - adds (or replaces) a key, returns the number of keys
+;     $&pcre.replacemap(text,handle) - replaces all keys found in the text by their values in one pass
+;   $&pcre.filter(record,fieldSeparator,search,mode,max,.next) - returns indexes ("i"), fields ("f") or a bitmap ("b") of matching fields
+;   $&pcre.cache(size,memory) - sets compiled pattern cache limits, returns size,memory,count,used,hits,misses
+;   $&pcre.limits(match,depth,heap,timeout) - sets match resource limits and timeout (ms), returns match,depth,heap,timeout
+;   $&pcre.preload(manifest,store) - caches compiled patterns of a manifest, shared through a store file, returns their count
 ;
 
 pcreexamples
@@ -22,6 +57,26 @@ pcreexamples
   d pcreMatchRecord(.tests)
   d pcreMatchVector(.tests)
   d pcreMatchIsset(.tests)
+  d pcreMatchExport(.tests)
+  d pcreMatchHandle(.tests)
+  d pcreNative(.tests)
+  d pcreMatchAll(.tests)
+  d pcreSplit(.tests)
+  d pcreLiteral(.tests)
+  d pcrePrefilter(.tests)
+  d pcreGscan(.tests)
+  d pcreGreplace(.tests)
+  d pcreGkeys(.tests)
+  d pcreIndex(.tests)
+  d pcreGrepfile(.tests)
+  d pcreStream(.tests)
+  d pcreSet(.tests)
+  d pcreFilter(.tests)
+  d pcreLex(.tests)
+  d pcreReplaceMap(.tests)
+  d pcreCache(.tests)
+  d pcreLimits(.tests)
+  d pcrePreload(.tests)
   d summary(.tests)
   q
 
@@ -99,6 +154,11 @@ pcreTest(tests)
   s expected=8
   d checkEquality(.tests,expected,found)
 
+  ; Count words (JIT-compiled, falls back to the interpreter when JIT is not available)
+  s found=$&pcre.test("Polish dąb is an oak in english","/\b\w+/gj")
+  s expected=7
+  d checkEquality(.tests,expected,found)
+
   ; Count characters (UTF-8)
   s found=$&pcre.test("dąb","/./g")
   s expected=3
@@ -582,6 +642,1113 @@ pcreMatchIsset(tests)
   q
 
 
+; $&pcre.export(name,separator) - all capture groups of the current match in a local variable
+;
+; NOTES:
+; The variable is killed, then name(index) and name(groupName) are set for every capture group set by the match, so $D() works like $&pcre.isset().
+; With a separator name(indexOrGroupName,"z") is set to firstIndex_separator_lastIndex like in $&pcre.zvector().
+; Returns the number of numbered capture groups set, including the whole match (0).
+
+pcreMatchExport(tests)
+  n exception,expected,found,seg
+
+  s seg("stale")=1
+  i $&pcre.match("PID|1|12345^^^HOSP|DOE^JOHN","/(?<segment>\w+)\|(?<set>\d+)\|(?<id>\d+)(?<check>\^\d)?\^\^\^(?<facility>\w+)\|(?<family>\w+)\^(?<given>\w+)/")
+  s found=$&pcre.export("seg")
+  s expected=7
+  d checkEquality(.tests,expected,found)
+
+  s found=seg("id")_" "_seg(3)_" "_seg("family")_","_seg("given")
+  s expected="12345 12345 DOE,JOHN"
+  d checkEquality(.tests,expected,found)
+
+  ; Unset groups and old nodes are not there
+  s found=$d(seg("check"))_$d(seg(4))_$d(seg("stale"))
+  s expected="000"
+  d checkEquality(.tests,expected,found)
+
+  ; Subscripted variable with zvectors
+  k seg
+  s found=$&pcre.export("seg(""PID"")","|")
+  s expected=7
+  d checkEquality(.tests,expected,found)
+
+  s found=seg("PID","facility","z")
+  s expected="15|18"
+  d checkEquality(.tests,expected,found)
+
+  ; Only local variables
+  d catch(.exception,"pcreMatchExport1")
+  i $&pcre.export("^seg")
+pcreMatchExport1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call export",.exception)
+  s found=$&pcre.error()
+  s expected="16397,&pcre.export,%PCRE-E-NAME, Invalid variable name"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.hmatch(text,search,separator) - match with a handle
+;
+; NOTES:
+; Any number of handle matches can be iterated at the same time, $&pcre.test(), $&pcre.replace() and $&pcre.match() don't affect them.
+; A handle stays valid until $&pcre.hfree() or until $&pcre.hnext() finds no more matches.
+
+pcreMatchHandle(tests)
+  n exception,expected,found,words,digits
+
+  s words=$&pcre.hmatch("The quick brown fox","/(?<word>\w+)/g")
+  s digits=$&pcre.hmatch("a1b2c3","/(\w)(\d)/g","|")
+
+  ; Record of the current match
+  s found=$&pcre.hrecord(digits)
+  s expected="a|1"
+  d checkEquality(.tests,expected,found)
+
+  ; Other calls don't destroy handle matches
+  i $&pcre.test("The quick brown fox","/fox/")
+  s found=$&pcre.hget(words,"word")
+  s expected="The"
+  d checkEquality(.tests,expected,found)
+
+  ; Iterating two matches at once
+  s found=$&pcre.hnext(words)_$&pcre.hnext(digits)
+  s expected="1b|2"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.hget(words,"word")
+  s expected="quick"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.hzvector(words,"word")
+  s expected="5|9"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.hisset(words,1)
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  ; No more matches, the handle is freed
+  i $&pcre.hnext(digits)
+  s found=$&pcre.hnext(digits)
+  s expected=""
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.hend(digits)
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  d catch(.exception,"pcreMatchHandle1")
+  i $&pcre.hget(digits,1)
+pcreMatchHandle1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call hget",.exception)
+  s found=$&pcre.error()
+  s expected="16396,&pcre.hget,%PCRE-E-HANDLE, Invalid match handle"
+  d checkEquality(.tests,expected,found)
+
+  ; Free a handle before the end
+  s found=$&pcre.hfree(words)
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  ; No match, no handle
+  s found=$&pcre.hmatch("The quick brown fox","/\d/")
+  s expected=0
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.matchn(text,search,separator,.output) and other native calls
+;
+; NOTES:
+; Native calls return 1 (matched, group set), 0 (no match, no more matches, group not set) or -1 on errors, see $&pcre.error().
+; $&pcre.testn() returns the number of matches, $&pcre.replacen() 0, $&pcre.hmatchn() the handle.
+; Strings are returned in output passed by reference, matchn() and nextn() set it to the record when there is a separator.
+
+pcreNative(tests)
+  n expected,found,output,rc,handle
+
+  s found=$&pcre.testn("a1b2c3","/\d/g")
+  s expected=3
+  d checkEquality(.tests,expected,found)
+
+  s rc=$&pcre.replacen("a1b2c3","/\d/g","#",.output)
+  s found=rc_":"_output
+  s expected="0:a#b#c#"
+  d checkEquality(.tests,expected,found)
+
+  s rc=$&pcre.matchn("a1b2c3","/(\w)(\d)/g","|",.output)
+  s found=rc_":"_output
+  s expected="1:a|1"
+  d checkEquality(.tests,expected,found)
+
+  s rc=$&pcre.getn(2,.output)
+  s found=rc_":"_output
+  s expected="1:1"
+  d checkEquality(.tests,expected,found)
+
+  s rc=$&pcre.nextn(.output)
+  s found=rc_":"_output_":"_$&pcre.issetn(1)
+  s expected="1:b|2:1"
+  d checkEquality(.tests,expected,found)
+
+  ; No more matches
+  s rc=$&pcre.nextn(.output),rc=$&pcre.nextn(.output)
+  s found=rc_":"_output
+  s expected="0:"
+  d checkEquality(.tests,expected,found)
+
+  ; Errors don't raise an exception
+  s found=$&pcre.getn(1,.output)
+  s expected=-1
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.error()
+  s expected="16393,&pcre.getn,%PCRE-E-END, No more matches"
+  d checkEquality(.tests,expected,found)
+
+  ; Handles
+  s handle=$&pcre.hmatchn("The quick brown fox","/(?<word>\w+)/g","")
+  s rc=$&pcre.hnextn(handle,.output),rc=$&pcre.hgetn(handle,"word",.output)
+  s found=rc_":"_output
+  s expected="1:quick"
+  d checkEquality(.tests,expected,found)
+
+  s rc=$&pcre.hzvectorn(handle,"word","",.output)
+  s found=rc_":"_output
+  s expected="1:5|9"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.hfree(handle)
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.matchall(text,search,fieldSeparator,recordSeparator,max,.offset) - all matches in one call
+;
+; NOTES:
+; Every match is a record of its capture groups (or of the whole match if there are no groups), "/a" and "/v" work like in $&pcre.match().
+; Passed by reference, offset tells where to start (0 is the beginning) and is set to where to resume, 0 when there are no more matches.
+; Matching stops after max matches or when the next record would exceed the M string length limit.
+
+pcreMatchAll(tests)
+  n exception,expected,found,offset
+
+  ; All matches (whole match, no capture groups)
+  s found=$&pcre.matchall("The quick brown fox jumps over the lazy dog","/\w+/","",",")
+  s expected="The,quick,brown,fox,jumps,over,the,lazy,dog"
+  d checkEquality(.tests,expected,found)
+
+  ; All matches with capture groups
+  s found=$&pcre.matchall("brown fox lazy dog","/(?<first>\w+) (?<second>\w+)/","|",";")
+  s expected="brown|fox;lazy|dog"
+  d checkEquality(.tests,expected,found)
+
+  ; Position vectors
+  s found=$&pcre.matchall("The quick brown fox","/(\w)\w*/v","|",",")
+  s expected="1|1,5|5,11|11,17|17"
+  d checkEquality(.tests,expected,found)
+
+  ; No match
+  s found=$&pcre.matchall("The quick brown fox","/\d+/","",",")
+  s expected=""
+  d checkEquality(.tests,expected,found)
+
+  ;; Paging through matches, 4 at a time
+  n words
+  s words="The,quick,brown,fox;jumps,over,the,lazy;dog"
+  s offset=0
+  n i
+  f  d  q:'offset
+  . s found=$&pcre.matchall("The quick brown fox jumps over the lazy dog","/\w+/","",",",4,.offset)
+  . s expected=$p(words,";",$i(i))
+  . d checkEquality(.tests,expected,found)
+  d checkEquality(.tests,3,i)
+
+  ; Paging through empty matches
+  s offset=0,found=""
+  f  d  q:'offset
+  . s found=found_$&pcre.matchall("ab","//v","|",",",1,.offset)_";"
+  s expected="1|0;2|1;3|2;"
+  d checkEquality(.tests,expected,found)
+
+  ; Resuming checks the subject is valid UTF-8 too
+  s offset=-2
+  d catch(.exception,"pcreMatchAll1")
+  i $&pcre.matchall("ab"_$zch(255),"//v","|",",",1,.offset)
+pcreMatchAll1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call matchall",.exception)
+  s found=$&pcre.error()
+  s expected="16389,&pcre.matchall,%PCRE-E-MATCH, Match error: UTF-8 error: illegal byte (0xfe or 0xff)"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.split(text,search,outputSeparator,limit,groups) - text between matches
+;
+; NOTES:
+; Fields are joined by outputSeparator, "," when it is omitted.
+; Limit over 0 is the maximum number of fields, 0 drops trailing empty fields, below 0 keeps them.
+; An empty match at the start or end of the text, or right after the previous match, doesn't split it.
+; With groups set to 1, capture groups (empty when not set) follow the field before their match.
+
+pcreSplit(tests)
+  n expected,found
+
+  s found=$&pcre.split("a, b,c,,","/,\s*/","|")
+  s expected="a|b|c"
+  d checkEquality(.tests,expected,found)
+
+  ; Default output separator
+  s found=$&pcre.split("a b  c","/\s+/")
+  s expected="a,b,c"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.split("a, b,c,,","/,\s*/","|",-1)
+  s expected="a|b|c||"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.split("a, b,c,,","/,\s*/","|",2)
+  s expected="a|b,c,,"
+  d checkEquality(.tests,expected,found)
+
+  ; Empty matches split characters
+  s found=$&pcre.split("dąb","//",",")
+  s expected="d,ą,b"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.split("a b  c","/\s*/",",")
+  s expected="a,b,c"
+  d checkEquality(.tests,expected,found)
+
+  ; Capture groups
+  s found=$&pcre.split("2024-05/01","/([-\/])/","|",0,1)
+  s expected="2024|-|05|/|01"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.split("a1b","/(\d)(x)?/","|",0,1)
+  s expected="a|1||b"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; Literal patterns
+;
+; NOTES:
+; Patterns without metacharacters skip PCRE2, results must be the same as with an equivalent regular expression.
+; Case-insensitive literals need the 'z' option (ASCII folding), subjects with invalid UTF-8 still report the PCRE2 error.
+
+pcreLiteral(tests)
+  n expected,found,text
+  s text="ERROR: disk, error: retry, Error: timeout, ERRORS"
+
+  ; Counting
+  s found=$&pcre.test(text,"/ERROR/g")
+  s expected=$&pcre.test(text,"/(?:ERROR)/g")
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.test(text,"/error/giz")
+  s expected=4
+  d checkEquality(.tests,expected,found)
+
+  ; Positions
+  s found=$&pcre.matchall(text,"/ERROR/v","|",",")
+  s expected="1|5,44|48"
+  d checkEquality(.tests,expected,found)
+
+  ; Replacing
+  s found=$&pcre.replace(text,"/error/giz","E")
+  s expected="E: disk, E: retry, E: timeout, ES"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.replace(text,"/ERROR/","<$0>")
+  s expected="<ERROR>: disk, error: retry, Error: timeout, ERRORS"
+  d checkEquality(.tests,expected,found)
+
+  ; UTF-8 subject
+  s found=$&pcre.test("dąb, dąbek","/dąb/g")
+  s expected=2
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; Prefilter
+;
+; NOTES:
+; Subjects shorter than the shortest match, or missing a code unit every match contains, are rejected before matching.
+; Inline options are taken into account, (?i) makes the required letters match in both cases.
+
+pcrePrefilter(tests)
+  n expected,found
+
+  ; Required first and last code units
+  s found=$&pcre.test("disk full","/ERROR: \d+/")
+  s expected=0
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.test("ERROR: 42","/ERROR: \d+/")
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  ; Inline caseless option
+  s found=$&pcre.test("Fatal: DISK full","/(?i)fatal.*disk/")
+  s expected=1
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.test("error: DISK","/E(?i)rror/")
+  s expected=0
+  d checkEquality(.tests,expected,found)
+
+  ; Minimum length
+  s found=$&pcre.test("2024-1","/\d{4}-\d\d/")
+  s expected=0
+  d checkEquality(.tests,expected,found)
+
+  ; Global match continues after the prefilter rejects the rest of the subject
+  s found=$&pcre.test("x1y x2y x3","/x\dy/g")
+  s expected=2
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.gscan(name,search,max,resultName,threads) - regular expression scan over a variable subtree
+;
+; NOTES:
+; The subtree (global or local, including its root node) is walked in collation order, the pattern is compiled once.
+; References of matching nodes are returned one per line, or set into resultName(1..n) and their count is returned.
+; Scan stops after max matching nodes (0 is no limit).
+; With threads>1 values are matched by worker threads, nodes are still read (and results returned) in collation order.
+; Thread count defaults to $pcre_scan_threads.
+
+pcreGscan(tests)
+  n exception,expected,found,data,result
+  s data="root ERROR"
+  s data(1)="ok"
+  s data(2)="ERROR: disk full"
+  s data(2,"x")="fine"
+  s data(2,"y")="error: retry"
+  s data(10)="ERROR: timeout"
+  s data("key")="ERROR: key"
+
+  ; Matching nodes in collation order
+  s found=$&pcre.gscan("data","/^ERROR/")
+  s expected="data"_$c(10)_"data(2)"_$c(10)_"data(10)"_$c(10)_"data(""key"")"
+  d checkEquality(.tests,expected,found)
+
+  ; Subtree
+  s found=$&pcre.gscan("data(2)","/error/i")
+  s expected="data(2)"_$c(10)_"data(2,""y"")"
+  d checkEquality(.tests,expected,found)
+
+  ; Limited number of results
+  s found=$&pcre.gscan("data","/ERROR/",2)
+  s expected="data"_$c(10)_"data(2)"
+  d checkEquality(.tests,expected,found)
+
+  ; Results in a local array
+  s found=$&pcre.gscan("data","/: \w+$/",0,"result")
+  s expected=3
+  d checkEquality(.tests,expected,found)
+  s found=@result(3)
+  s expected="ERROR: key"
+  d checkEquality(.tests,expected,found)
+
+  ; Worker threads, same results in the same order
+  s found=$&pcre.gscan("data","/^ERROR/",0,"",4)
+  s expected="data"_$c(10)_"data(2)"_$c(10)_"data(10)"_$c(10)_"data(""key"")"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.gscan("data","/ERROR/",2,"",4)
+  s expected="data"_$c(10)_"data(2)"
+  d checkEquality(.tests,expected,found)
+
+  ; Invalid variable name
+  d catch(.exception,"pcreGscan1")
+  i $&pcre.gscan("data(","/ERROR/")
+pcreGscan1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call gscan",.exception)
+  s found=$&pcre.error()
+  s expected="16397,&pcre.gscan,%PCRE-E-NAME, Invalid variable name"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.greplace(name,search,replace,batch) - regular expression replace over a variable subtree
+;
+; NOTES:
+; The subtree is walked like gscan(), nodes whose value changes are set back and scanned,changed node counts are returned.
+; Changed nodes are set in transactions of up to batch nodes (default 256), batch 0 sets them without transactions.
+; Inside the transaction each node is read again and replaced again if its value changed since the scan.
+
+pcreGreplace(tests)
+  n exception,expected,found,data
+  s data="root cat"
+  s data(1)="cat and cat"
+  s data(2)="dog"
+  s data(3,"x")="CAT"
+
+  ; Changed nodes only
+  s found=$&pcre.greplace("data","/cat/g","lion")
+  s expected="4,2"
+  d checkEquality(.tests,expected,found)
+  s found=data_"|"_data(1)_"|"_data(2)_"|"_data(3,"x")
+  s expected="root lion|lion and lion|dog|CAT"
+  d checkEquality(.tests,expected,found)
+
+  ; Subtree, replacement with groups
+  s found=$&pcre.greplace("data(3)","/(C)AT/i","$1OW")
+  s expected="1,1"
+  d checkEquality(.tests,expected,found)
+  s found=data(3,"x")
+  s expected="COW"
+  d checkEquality(.tests,expected,found)
+
+  ; One node per transaction, no transactions
+  s found=$&pcre.greplace("data","/lion/","tiger",1)
+  s expected="4,2"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.greplace("data","/tiger/","cat",0)
+  s expected="4,2"
+  d checkEquality(.tests,expected,found)
+  s found=data_"|"_data(1)
+  s expected="root cat|cat and lion"
+  d checkEquality(.tests,expected,found)
+
+  ; Invalid variable name
+  d catch(.exception,"pcreGreplace1")
+  i $&pcre.greplace("data(","/cat/","dog")
+pcreGreplace1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call greplace",.exception)
+  s found=$&pcre.error()
+  s expected="16397,&pcre.greplace,%PCRE-E-NAME, Invalid variable name"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.gkeys(name,search,max,resultName) - regular expression scan over the subscripts below a node
+;
+; NOTES:
+; Subscripts directly below the node are matched in collation order, results are returned like gscan() returns them.
+; A search anchored with ^ or \A followed by literal text reads only the subscripts starting with that text.
+; Caseless, extended or multiline searches, alternatives at the top level and number-like prefixes read all subscripts.
+
+pcreGkeys(tests)
+  n exception,expected,found,acct,result
+  s acct(10)=""
+  s acct(12)=""
+  s acct("ACCT-2023-7")=""
+  s acct("ACCT-2024-1")=""
+  s acct("ACCT-2024-1","x")=""
+  s acct("ACCT-2024-2")=""
+  s acct("ACCT-2024-x")=""
+  s acct("BANK-1")=""
+  s acct("bank-2")=""
+
+  ; Literal prefix
+  s found=$&pcre.gkeys("acct","/^ACCT-2024-\d+$/")
+  s expected="acct(""ACCT-2024-1"")"_$c(10)_"acct(""ACCT-2024-2"")"
+  d checkEquality(.tests,expected,found)
+
+  ; Optional last character, not part of the prefix
+  s found=$&pcre.gkeys("acct","/^ACCT-2024-1?x/")
+  s expected="acct(""ACCT-2024-x"")"
+  d checkEquality(.tests,expected,found)
+
+  ; Numbers, alternatives, caseless
+  s found=$&pcre.gkeys("acct","/^1\d$/")
+  s expected="acct(10)"_$c(10)_"acct(12)"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.gkeys("acct","/^ACCT-2023|^BANK/")
+  s expected="acct(""ACCT-2023-7"")"_$c(10)_"acct(""BANK-1"")"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.gkeys("acct","/^bank/i")
+  s expected="acct(""BANK-1"")"_$c(10)_"acct(""bank-2"")"
+  d checkEquality(.tests,expected,found)
+
+  ; Below a subscript, limited number of results, results in a local array
+  s found=$&pcre.gkeys("acct(""ACCT-2024-1"")","/^x$/")
+  s expected="acct(""ACCT-2024-1"",""x"")"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.gkeys("acct","/^ACCT/",1,"result")
+  s expected=1
+  d checkEquality(.tests,expected,found)
+  s found=result(1)
+  s expected="acct(""ACCT-2023-7"")"
+  d checkEquality(.tests,expected,found)
+
+  ; Invalid variable name
+  d catch(.exception,"pcreGkeys1")
+  i $&pcre.gkeys("acct(","/^ACCT/")
+pcreGkeys1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call gkeys",.exception)
+  s found=$&pcre.error()
+  s expected="16397,&pcre.gkeys,%PCRE-E-NAME, Invalid variable name"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.ixbuild(name,indexName), $&pcre.ixupdate(indexName,node), $&pcre.ixscan(indexName,search,max,resultName) - indexed search
+;
+; NOTES:
+; The index keeps the trigrams (ASCII letters in lower case) of every value, ixbuild() kills it first.
+; ixscan() matches only nodes whose value has all trigrams of the literal text of search, results come like gscan() returns them.
+; Searches without such text read every indexed node. Nodes changed without ixupdate() may be missed.
+
+pcreIndex(tests)
+  n exception,expected,found,data,index
+  s data(1)="The quick brown fox"
+  s data(2)="jumps over the lazy dog"
+  s data(3)="colour and color"
+  s data(3,"x")="quick again"
+
+  s found=$&pcre.ixbuild("data","index")
+  s expected=4
+  d checkEquality(.tests,expected,found)
+
+  ; Trigrams of literal text, caseless
+  s found=$&pcre.ixscan("index","/quick/")
+  s expected="data(1)"_$c(10)_"data(3,""x"")"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.ixscan("index","/QUICK B/i")
+  s expected="data(1)"
+  d checkEquality(.tests,expected,found)
+
+  ; Optional characters and groups are not required
+  s found=$&pcre.ixscan("index","/colou?r/")
+  s expected="data(3)"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.ixscan("index","/(fox|dog)$/")
+  s expected="data(1)"_$c(10)_"data(2)"
+  d checkEquality(.tests,expected,found)
+
+  ; Changed nodes are found after ixupdate()
+  s data(2)="a new value"
+  s found=$&pcre.ixscan("index","/new value/")
+  s expected=""
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.ixupdate("index",$na(data(2)))
+  s expected=1
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.ixscan("index","/new value|lazy/")
+  s expected="data(2)"
+  d checkEquality(.tests,expected,found)
+  k data(1)
+  s found=$&pcre.ixupdate("index",$na(data(1)))
+  s expected=0
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.ixscan("index","/quick/")
+  s expected="data(3,""x"")"
+  d checkEquality(.tests,expected,found)
+
+  ; Index inside the subtree
+  d catch(.exception,"pcreIndex1")
+  i $&pcre.ixbuild("data","data(""ix"")")
+pcreIndex1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call ixbuild",.exception)
+  s found=$&pcre.error()
+  s expected="16397,&pcre.ixbuild,%PCRE-E-NAME, Invalid variable name"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.grepfile(path,search,mode,max,resultName) - regular expression search in a file
+;
+; NOTES:
+; The file is mapped into memory and matched in place, lines are not limited to the maximum M string length.
+; Mode "l" (default) reports the first match of every line, the newline is not part of the subject.
+; Mode "m" matches the whole file and reports every match, matches may span lines.
+; Results are "line,offset" (offset of the match in the file, from 1), one per line or in resultName(1..n).
+
+pcreGrepfile(tests)
+  n exception,expected,found,file,result
+  s file="/tmp/pcreexamples."_$j_".txt"
+  o file:(newversion) u file
+  w "alpha",!,"ERROR one",!,"beta ERROR",!,!,"last ERROR",!
+  c file
+
+  ; First match of every line
+  s found=$&pcre.grepfile(file,"/ERROR/")
+  s expected="2,7"_$c(10)_"3,22"_$c(10)_"5,34"
+  d checkEquality(.tests,expected,found)
+
+  ; Anchors apply to lines
+  s found=$&pcre.grepfile(file,"/^$/")
+  s expected="4,28"
+  d checkEquality(.tests,expected,found)
+
+  ; Matches across lines
+  s found=$&pcre.grepfile(file,"/a\nE/","m")
+  s expected="1,5"
+  d checkEquality(.tests,expected,found)
+
+  ; Limited number of results in a local array
+  s found=$&pcre.grepfile(file,"/ERROR/","l",2,"result")
+  s expected=2
+  d checkEquality(.tests,expected,found)
+  s found=result(2)
+  s expected="3,22"
+  d checkEquality(.tests,expected,found)
+
+  o file c file:(delete)
+
+  ; Missing file
+  d catch(.exception,"pcreGrepfile1")
+  i $&pcre.grepfile(file,"/ERROR/")
+pcreGrepfile1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call grepfile",.exception)
+  s found=$&pcre.error()
+  s expected="16399,&pcre.grepfile,%PCRE-E-FILE, File error: "_file_": No such file or directory"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.streamopen(search), $&pcre.feed(handle,chunk), $&pcre.streamclose(handle) - matching a subject fed in chunks
+;
+; NOTES:
+; Matches may span chunks, positions are absolute (from 1) within the whole subject.
+; A match that more input could still extend is reported by a later feed() or by streamclose().
+; Only the tail of the subject that a match in progress may need is kept between chunks.
+
+pcreStream(tests)
+  n exception,expected,found,handle
+
+  s handle=$&pcre.streamopen("/\d+/")
+  s found=$&pcre.feed(handle,"abc 12")
+  s expected=""
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.feed(handle,"34 def 5")
+  s expected="5,8"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.feed(handle,"6 and 78 ")
+  s expected="14,15"_$c(10)_"21,22"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.streamclose(handle)
+  s expected=""
+  d checkEquality(.tests,expected,found)
+
+  ; Match at the end of the subject
+  s handle=$&pcre.streamopen("/end$/")
+  s found=$&pcre.feed(handle,"the e")
+  s found=found_$&pcre.feed(handle,"nd")
+  s expected=""
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.streamclose(handle)
+  s expected="5,7"
+  d checkEquality(.tests,expected,found)
+
+  ; Closed handle
+  d catch(.exception,"pcreStream1")
+  i $&pcre.feed(handle,"more")
+pcreStream1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call feed",.exception)
+  s found=$&pcre.error()
+  s expected="16396,&pcre.feed,%PCRE-E-HANDLE, Invalid match handle"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.setcreate(), $&pcre.setadd(handle,search), $&pcre.setmatch(handle,text,mode) - one subject against many patterns
+;
+; NOTES:
+; Patterns are tested in the order they were added, "f" stops at the first matching one.
+; A map of the bytes in the subject is built once per call and rules out most patterns without matching them.
+
+pcreSet(tests)
+  n exception,expected,found,handle
+
+  s handle=$&pcre.setcreate()
+  i $&pcre.setadd(handle,"/ERROR: \d+/")
+  i $&pcre.setadd(handle,"/(?i)fatal.*disk/")
+  i $&pcre.setadd(handle,"/\d{4}-\d\d/")
+  s found=$&pcre.setadd(handle,"/timeout|refused/")
+  s expected=4
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.setmatch(handle,"2024-05-01 ERROR: 42")
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.setmatch(handle,"2024-05-01 ERROR: 42","a")
+  s expected="1,3"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.setmatch(handle,"Fatal: disk full, connection refused","c")
+  s expected=2
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.setmatch(handle,"all good","a")
+  s expected=""
+  d checkEquality(.tests,expected,found)
+
+  d catch(.exception,"pcreSet1")
+  i $&pcre.setmatch(handle,"all good","x")
+pcreSet1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call setmatch",.exception)
+  s found=$&pcre.error()
+  s expected="16387,&pcre.setmatch,%PCRE-E-OPT, Invalid options"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.hfree(handle)
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.filter(record,fieldSeparator,search,mode,max,.next) - matching every field of a record
+;
+; NOTES:
+; Fields are numbered like in $Piece(), an empty record is one empty field.
+; Results stop before max matches (0 is no limit) or the maximum string length, next is then the field to continue from, 0 at the end.
+
+pcreFilter(tests)
+  n exception,expected,found,next
+
+  s found=$&pcre.filter("A12,b7,C3,,x",",","/\d/")
+  s expected="1,2,3"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.filter("A12,b7,C3,,x",",","/^[A-Z]/","f")
+  s expected="A12,C3"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.filter("A12,b7,C3,,x",",","/^$/","b")
+  s expected="00010"
+  d checkEquality(.tests,expected,found)
+
+  ; In chunks of 2 matches
+  s next=0
+  s found=$&pcre.filter("a1|b2|c3|d4","|","/\d/","i",2,.next)_";"_next
+  s expected="1,2;3"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.filter("a1|b2|c3|d4","|","/\d/","i",2,.next)_";"_next
+  s expected="3,4;0"
+  d checkEquality(.tests,expected,found)
+
+  d catch(.exception,"pcreFilter1")
+  i $&pcre.filter("a,b","","/a/")
+pcreFilter1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call filter",.exception)
+  s found=$&pcre.error()
+  s expected="16395,&pcre.filter,%PCRE-E-ARG, Invalid argument"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.lexcreate(), $&pcre.lexrule(handle,name,search), $&pcre.lex(handle,text,separator,recordSeparator) - tokenising
+;
+; NOTES:
+; The first rule that matches at a position (in the order rules were added) gives the token, empty matches are not tokens.
+; Text no rule matches is returned as tokens with an empty rule name.
+; Options i, m, s and x apply to their rule only, z must be the same for all rules.
+; Back references, subroutine calls, verbs and (?x) are refused, combined with other rules they would refer to their groups.
+
+pcreLex(tests)
+  n exception,expected,found,handle
+
+  s handle=$&pcre.lexcreate()
+  i $&pcre.lexrule(handle,"segment","/[A-Z]{3}/")
+  i $&pcre.lexrule(handle,"separator","/[|^~]/")
+  s found=$&pcre.lexrule(handle,"number","/\d+(?:\.\d+)?/")
+  s expected=3
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.lex(handle,"MSH|12.5^x","|",";")
+  s expected="segment|1|3;separator|4|4;number|5|8;separator|9|9;|10|10"
+  d checkEquality(.tests,expected,found)
+
+  ; Rule options
+  i $&pcre.lexrule(handle,"word","/[a-z]+/i")
+  s found=$&pcre.lex(handle,"Ab~ąb","|",";")
+  s expected="word|1|2;separator|3|3;|4|5;word|6|6"
+  d checkEquality(.tests,expected,found)
+
+  d catch(.exception,"pcreLex1")
+  i $&pcre.lexrule(handle,"ascii","/[a-z]+/z")
+pcreLex1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call lexrule",.exception)
+  s found=$&pcre.error()
+  s expected="16387,&pcre.lexrule,%PCRE-E-OPT, Invalid options"
+  d checkEquality(.tests,expected,found)
+
+  ; Rules referring to their own groups
+  d catch(.exception,"pcreLex2")
+  i $&pcre.lexrule(handle,"string","/(['""]).*?\1/")
+pcreLex2
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call lexrule",.exception)
+  s found=$&pcre.error()
+  s expected="16388,&pcre.lexrule,%PCRE-E-PATTERN, Compilation failed in a lexer rule: back references, subroutine calls, verbs and (?x) are not supported"
+  d checkEquality(.tests,expected,found)
+  d catch(.exception,"pcreLex3")
+  i $&pcre.lexrule(handle,"utf","/(*UTF)x/")
+pcreLex3
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call lexrule",.exception)
+  s found=$&pcre.error()
+  s expected="16388,&pcre.lexrule,%PCRE-E-PATTERN, Compilation failed in a lexer rule: back references, subroutine calls, verbs and (?x) are not supported"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.lexrule(handle,"string","/' [^']* ' # quoted/x")
+  s expected=5
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.lex(handle,"'x'12","|",";")
+  s expected="string|1|3;number|4|5"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.hfree(handle)
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.mapcreate(options), $&pcre.mapadd(handle,key,value), $&pcre.replacemap(text,handle) - many literal replacements in one pass
+;
+; NOTES:
+; Keys are literal strings, replaced leftmost first and the longest one when several start at the same position.
+; Replaced text isn't scanned again, adding a key again replaces its value.
+; Option "i" matches ASCII letters caseless.
+
+pcreReplaceMap(tests)
+  n exception,expected,found,handle
+
+  s handle=$&pcre.mapcreate()
+  i $&pcre.mapadd(handle,"Jan","January")
+  i $&pcre.mapadd(handle,"Jun","June")
+  s found=$&pcre.mapadd(handle,"June","June")
+  s expected=3
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.replacemap("Jan, June, Jun",handle)
+  s expected="January, June, June"
+  d checkEquality(.tests,expected,found)
+
+  ; Replaced value
+  s found=$&pcre.mapadd(handle,"Jan","I")
+  s expected=3
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.replacemap("Jan",handle)
+  s expected="I"
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.hfree(handle)
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  ; Caseless
+  s handle=$&pcre.mapcreate("i")
+  i $&pcre.mapadd(handle,"dąb","oak")
+  s found=$&pcre.replacemap("Dąb, DĄB, dąB",handle)
+  s expected="oak, DĄB, oak"
+  d checkEquality(.tests,expected,found)
+  i $&pcre.hfree(handle)
+
+  d catch(.exception,"pcreReplaceMap1")
+  i $&pcre.mapcreate("x")
+pcreReplaceMap1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call mapcreate",.exception)
+  s found=$&pcre.error()
+  s expected="16387,&pcre.mapcreate,%PCRE-E-OPT, Invalid options"
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.cache(size,memory) - compiled pattern cache control
+;
+; NOTES:
+; Patterns are cached by their exact "/regex/options" string and evicted least recently used first.
+; Initial limits come from $pcre_cache_size and $pcre_cache_memory, changing limits flushes the cache.
+; Size 0 disables the cache.
+
+pcreCache(tests)
+  n exception,expected,found,hits
+
+  ; Flush the cache (keeping its limits)
+  s found=$p($&pcre.cache(4,1048576),",",1,3)
+  s expected="4,1048576,0"
+  d checkEquality(.tests,expected,found)
+
+  ; First use compiles the pattern
+  i $&pcre.test("The quick brown fox","/fox/i")
+  s hits=$p($&pcre.cache(),",",5)
+  s found=$p($&pcre.cache(),",",3)
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  ; Second use is a cache hit
+  s found=$&pcre.test("The quick brown FOX","/fox/i")
+  s expected=1
+  d checkEquality(.tests,expected,found)
+  s found=$p($&pcre.cache(),",",5)-hits
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  ; Least recently used patterns are evicted
+  n i
+  f i=1:1:5 i $&pcre.test("x","/x"_i_"/")
+  s found=$p($&pcre.cache(),",",3)
+  s expected=4
+  d checkEquality(.tests,expected,found)
+
+  ; Ongoing global match survives a flush
+  s found=$&pcre.match("a1b2c3","/\d/g")
+  i $&pcre.cache(0)
+  i $&pcre.next()
+  s found=$&pcre.get(0)
+  s expected=2
+  d checkEquality(.tests,expected,found)
+
+  ; Invalid limits
+  d catch(.exception,"pcreCache1")
+  i $&pcre.cache("x")
+pcreCache1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call cache",.exception)
+  s found=$&pcre.error()
+  s expected="16395,&pcre.cache,%PCRE-E-ARG, Invalid argument"
+  d checkEquality(.tests,expected,found)
+  d catch(.exception,"pcreCache2")
+  i $&pcre.cache(65537)
+pcreCache2
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call cache",.exception)
+
+  ; Limits up to those of $pcre_cache_size and $pcre_cache_memory
+  s found=$p($&pcre.cache(65536,4294967296),",",1,2)
+  s expected="65536,4294967296"
+  d checkEquality(.tests,expected,found)
+
+  ; Restore defaults
+  i $&pcre.cache(256,16777216)
+
+  q
+
+
+; $&pcre.limits(match,depth,heap,timeout) - match resource limits and timeout
+;
+; NOTES:
+; Limits are PCRE2 match, depth and heap (KiB) limits, initial values come from $pcre_match_limit, $pcre_depth_limit, $pcre_heap_limit.
+; Timeout (milliseconds, 0 is none, initially $pcre_timeout) applies to every match, changing it between 0 and not 0 flushes the pattern cache.
+; Empty arguments keep their current value.
+
+pcreLimits(tests)
+  n exception,expected,found,saved
+
+  s saved=$&pcre.limits()
+  s found=$&pcre.limits(1000)
+  s expected=1000_","_$p(saved,",",2,4)
+  d checkEquality(.tests,expected,found)
+
+  ; Catastrophic backtracking stops at the match limit
+  d catch(.exception,"pcreLimits1")
+  i $&pcre.test("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaab","/(a+)+$/")
+pcreLimits1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call test",.exception)
+  s found=$&pcre.error()
+  s expected="16400,&pcre.test,%PCRE-E-MATCHLIMIT, Resource limit exceeded: match limit exceeded"
+  d checkEquality(.tests,expected,found)
+
+  ; Or at the timeout
+  s found=$&pcre.limits(999999999,"","",50)
+  s expected="999999999,"_$p(saved,",",2,3)_",50"
+  d checkEquality(.tests,expected,found)
+  d catch(.exception,"pcreLimits2")
+  i $&pcre.test("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab","/(a+)+$/")
+pcreLimits2
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call test",.exception)
+  s found=$&pcre.error()
+  s expected="16401,&pcre.test,%PCRE-E-TIMEOUT, Match time limit exceeded"
+  d checkEquality(.tests,expected,found)
+
+  s found=$&pcre.limits($p(saved,",",1),$p(saved,",",2),$p(saved,",",3),$p(saved,",",4))
+  s expected=saved
+  d checkEquality(.tests,expected,found)
+
+  q
+
+
+; $&pcre.preload(manifest,store) - compiled patterns shared by processes
+;
+; NOTES:
+; The manifest lists /regex/options keys one per line, empty lines and lines starting with # are skipped.
+; The store (manifest path with ".store" by default) is rewritten when it doesn't match the manifest, PCRE2 build or timeout.
+; Returns the number of patterns added to the cache, those already cached are skipped.
+; $pcre_preload and $pcre_preload_store name a manifest loaded on the first call of a process.
+
+pcrePreload(tests)
+  n exception,expected,found,file,stat
+  s file="/tmp/pcreexamples."_$j_".pat"
+  o file:(newversion) u file
+  w "# log patterns",!,"/ERROR \d+/",!,!,"/(?<user>\w+)@(?<host>[\w.]+)/",!
+  c file
+
+  ; Builds the store
+  i $&pcre.cache(256,16777216)
+  s found=$&pcre.preload(file)
+  s expected=2
+  d checkEquality(.tests,expected,found)
+  s stat=$$fileStat(file_".store")
+
+  ; Patterns are cached
+  s found=$&pcre.preload(file)
+  s expected=0
+  d checkEquality(.tests,expected,found)
+  s found=$&pcre.test("ERROR 42","/ERROR \d+/")
+  s expected=1
+  d checkEquality(.tests,expected,found)
+
+  ; Another process (or a flushed cache) decodes the store
+  i $&pcre.cache(0),$&pcre.cache(256,16777216)
+  s found=$&pcre.preload(file)
+  s expected=2
+  d checkEquality(.tests,expected,found)
+  ; The store was decoded, not rewritten
+  s found=$$fileStat(file_".store")
+  s expected=stat
+  d checkEquality(.tests,expected,found)
+
+  ; A changed manifest rewrites the store
+  o file:(append) u file
+  w "/\d{4}-\d{2}-\d{2}/",!
+  c file
+  s found=$&pcre.preload(file)
+  s expected=1
+  d checkEquality(.tests,expected,found)
+  s found=$$fileStat(file_".store")'=stat
+  s expected=1
+  d checkEquality(.tests,expected,found)
+  i $&pcre.cache(0),$&pcre.cache(256,16777216)
+  s found=$&pcre.preload(file)
+  s expected=3
+  d checkEquality(.tests,expected,found)
+
+  ; Missing manifest
+  d catch(.exception,"pcrePreload1")
+  i $&pcre.preload(file_".none")
+pcrePreload1
+  d checkEquality(.tests,"%YDB-E-XCRETNULLREF, Returned null reference from external call preload",.exception)
+  s found=$p($&pcre.error(),",",1,2)
+  s expected="16399,&pcre.preload"
+  d checkEquality(.tests,expected,found)
+
+  o file c file:(delete)
+  o file_".store" c file_".store":(delete)
+
+  q
+
+
+fileStat(file) ; size and inode of "file": a rewritten store is renamed into place
+  n io,line,stat
+  s io=$io,stat=file_".stat"
+  zsystem "stat -c '%s %i' "_file_" >"_stat
+  o stat:(readonly) u stat r line c stat:(delete) u io
+  q line
+
 catch(variable,label) ; setup exception handler: save exception into "variable" and goto "label"
   s variable=""
   n code,variableName